@@ -21,6 +21,14 @@
 // Higher PARTITION means lower MRF ORDER. (PARTITION = SIZE/ORDER)
 #define PARTITION 120
 
+// Shape of the MRF neighborhood. A DISK holds the taps with l*l + m*m <= order,
+// a SQUARE the whole (2*order+1)^2 window, and an ELLIPSE divides each image
+// dimension by PARTITION separately, so non-square images get an anisotropic one.
+#define STENCIL_DISK    0
+#define STENCIL_SQUARE  1
+#define STENCIL_ELLIPSE 2
+#define STENCIL STENCIL_DISK
+
 #pragma pack(push, 1)
 typedef struct
 {
@@ -42,6 +50,15 @@ typedef struct
 } BMPINFOHEADER;
 #pragma pack(pop)
 
+struct Stencil //MRF neighborhood stored as spans, computed once per image
+{
+	int rows, cols;     // half-height and half-width of the bounding box
+	int *mStart, *mEnd; // row l covers columns mStart[l]..mEnd[l], for l = -rows..rows
+	int *lStart, *lEnd; // column m covers rows lStart[m]..lEnd[m], for m = -cols..cols
+	int *offset;        // byte offset of every tap from the center pixel, row by row
+	int taps;
+};
+
 struct Node //struct used for linked lists
 {
 	int row;
@@ -98,16 +115,52 @@ int overwrite_bitmap(char *filename, unsigned char **img)
 	return 0;
 }
 
-void is_neighbor(Ptr<Int> hl, Ptr<Int> hm, Ptr<Int> hord, Ptr<Int> hr)
+void build_stencil(struct Stencil *stencil, int shape, int rows, int cols, int byte_width, int byte_depth)
+{
+	//  All shapes are convex, so every row and every column of taps is one span.
+	//  An ellipse with radii rows, cols holds l*l*cols*cols + m*m*rows*rows <= (rows*cols)^2.
+	long long r2 = (long long) rows*rows, c2 = (long long) cols*cols;
+	int l, m, n = 0;
+	stencil->rows   = rows;
+	stencil->cols   = cols;
+	stencil->mStart = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+	stencil->mEnd   = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+	stencil->lStart = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+	stencil->lEnd   = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+	stencil->taps   = 0;
+	for (m = -cols; m <= cols; m++)
+	{
+		stencil->lStart[m] = rows + 1;
+		stencil->lEnd[m]   = -rows - 1;
+	}
+	for (l = -rows; l <= rows; l++)
+	{
+		int span = cols;
+		if (shape != STENCIL_SQUARE)
+			for (span = 0; span < cols && l*l*c2 + (span+1)*(span+1)*r2 <= r2*c2; span++);
+		stencil->mStart[l] = -span;
+		stencil->mEnd[l]   =  span;
+		stencil->taps     += 2*span + 1;
+		for (m = -span; m <= span; m++)
+		{
+			if (stencil->lStart[m] > l) stencil->lStart[m] = l;
+			if (stencil->lEnd[m]   < l) stencil->lEnd[m]   = l;
+		}
+	}
+
+	stencil->offset = (int*) malloc(stencil->taps * sizeof(int));
+	for (l = -rows; l <= rows; l++)
+		for (m = stencil->mStart[l]; m <= stencil->mEnd[l]; m++)
+			stencil->offset[n++] = l*byte_width + m*byte_depth;
+}
+
+void free_stencil(struct Stencil *stencil)
 {
-	Int dl   = *hl;
-	Int dm   = *hm;
-	Int dord = *hord;
-	Int dr;
-	Where (dl*dl + dm*dm <= dord)
-		dr = dord;
-	End
-	*hr = dr;
+	free(stencil->mStart - stencil->rows);
+	free(stencil->mEnd   - stencil->rows);
+	free(stencil->lStart - stencil->cols);
+	free(stencil->lEnd   - stencil->cols);
+	free(stencil->offset);
 }
 
 int main(){
@@ -152,16 +205,28 @@ int main(){
     int byte_width  = img_info.Width * byte_depth + byte_padd;
     int byte_offset = (img_info.Width < img_info.Height) ? 
 			img_info.Width/PARTITION : img_info.Height/PARTITION;
-    int R2 = byte_offset*byte_offset;
-    int D  = 2*byte_offset + 1;
-    int h, i, j, k, l, m;
-    /*char is_neighbor[D*D];
-    for (l = -byte_offset; l <= byte_offset; l++)
-		for (m = -byte_offset; m <= byte_offset; m++)
-			is_neighbor[(l+byte_offset)*D+m+byte_offset] = (l*l + m*m <= R2);*/
-	SharedArray<int> hl(D), hm(D), hord(D), hr(D);
-	auto k_eq = compile(is_neighbor);
-	k_eq.setNumQPUs(8);
+    int h, i, j, k, n;
+
+    //  Neighborhood taps of every pixel, as byte offsets from the pixel. The disk
+    //  test used to run on the QPUs (is_neighbor) for every pixel; it is now done
+    //  once per image. The Gibbs stage covers the pixels whose whole neighborhood
+    //  lies inside the image.
+    struct Stencil stencil;
+    if (STENCIL == STENCIL_ELLIPSE)
+        build_stencil(&stencil, STENCIL, img_info.Height/PARTITION, img_info.Width/PARTITION, byte_width, byte_depth);
+    else
+        build_stencil(&stencil, STENCIL, byte_offset, byte_offset, byte_width, byte_depth);
+    int taps = stencil.taps;
+
+    //  The Gibbs energy of a luminance only depends on how many neighbors share it:
+    //  E = 4*byte_offset^2 - 5*count. Only PDF weights exp(-E/TEMPERATURE) relative to each
+    //  other matter to the threshold, so they are taken relative to the neighborhood's most
+    //  frequent luminance, exp(-5*(peak - count)/TEMPERATURE), which never overflows at any
+    //  radius. They are tabulated once per image for every shortfall 0..taps.
+    double *gibbs_weight = (double*) malloc((taps+1) * sizeof(double));
+    for (g = 0; g <= taps; g++)
+        gibbs_weight[g] = exp(-5.0*g/TEMPERATURE);
+
     for (h = 0; h < ITERATIONS; h++)
     {
         //  In the beginning of every iteration:
@@ -173,8 +238,8 @@ int main(){
         img_mask = img_copy;
         img_copy = img_to_modify;
 
-        for (i = byte_offset; i < img_info.Height-byte_offset; i++)
-            for (j = byte_offset; j < img_info.Width-byte_offset; j++)
+        for (i = stencil.rows; i < img_info.Height-stencil.rows; i++)
+            for (j = stencil.cols; j < img_info.Width-stencil.cols; j++)
                 for (k = 0; k < byte_depth; k++)
                 {
                     // Initialize Gibbs CDF array
@@ -184,28 +249,22 @@ int main(){
                            gibbs_CDF[0] = 0;    // The first element is for making CDF 
                                                 // generation easier by having an index 0
                                                 // for lum -1, whose gibbs_PDF is 0.
-                    int lum;
+                    int lum, gibbs_count[256];
+                    for (lum = 0; lum <= 255; lum++)
+                        gibbs_count[lum] = 0;
+
+                    // Count the Markovian Neighbors of each luminance
+                    unsigned char *center = &img_copy[i*byte_width+j*byte_depth+k];
+                    for (n = 0; n < taps; n++)
+                        gibbs_count[center[stencil.offset[n]]]++;
+
+                    // Generate CDF (Must be scalar) from the tabulated Gibbs weights,
+                    // indexed by each luminance's shortfall from the peak count
+                    int peak = 0;
                     for (lum = 0; lum <= 255; lum++)
-                        gibbs_CDF[lum+1] = R2 << 2;
-
-                    // Calculate Equipotential of each luminance using Markovian Neighbors
-                    for (l = -byte_offset; l <= byte_offset; l+=1){
-						int n;
-						for (n = 0; n < D; n++)
-						{
-							hl[n]   = l;
-							hm[n]   = n - byte_offset;
-							hord[n] = R2;
-							hr[n]   = 0;
-						}
-						k_eq(&hl, &hm, &hord, &hr);
-                        for (m = -byte_offset; m <= byte_offset; m+=1)
-                            gibbs_CDF[img_copy[(i+l)*byte_width+(j+m)*byte_depth+k]+1] -= (hr[m + byte_offset]) ? 5 : 0;
-					}
-                            
-                    // Generate CDF (Must be scalar)
+                        peak = (gibbs_count[lum] > peak) ? gibbs_count[lum] : peak;
                     for (lum = 0; lum <= 255; lum++)
-                        gibbs_CDF[lum+1] = gibbs_CDF[lum] + exp(-gibbs_CDF[lum+1]/TEMPERATURE);
+                        gibbs_CDF[lum+1] = gibbs_CDF[lum] + gibbs_weight[peak - gibbs_count[lum]];
 
                     // Threshold CDF ///// Vectorizable
                     for (lum = 0; lum <= 255; lum++)
@@ -296,5 +355,7 @@ int main(){
     free(img_mask);
     free(img_copy);
     free(BFSArray);
+    free(gibbs_weight);
+    free_stencil(&stencil);
     return 0;
 }
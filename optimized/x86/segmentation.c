@@ -1,8 +1,26 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, to pin workers to their NUMA node
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
+#include <float.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <immintrin.h> // every kernel is compiled for its own instruction set, see select_isa
+
+// The hot kernels exist for AVX-512, AVX2, SSE4.2 and plain x86-64 hosts, so one binary
+// runs on all of them. The widest the CPU supports is picked at startup; the SEG_ISA
+// environment variable (avx512, avx2, sse4.2 or scalar) forces a narrower one.
+#define ISA_SCALAR 0
+#define ISA_SSE42  1
+#define ISA_AVX2   2
+#define ISA_AVX512 3
 
 // Higher temperature smoothens the image more. It's like a pre-filter.
 // It will make more likely for pixels within object boundary to be grouped.
@@ -12,6 +30,12 @@
 // Eventually it will converge and yield diminishing returns.
 #define ITERATIONS 3 // is usually Just enough
 
+// Iterating stops early once a pass changes less than this fraction of the pixel
+// channels it computes, of every image of a batch; ITERATIONS is then only the cap.
+// 0 always runs every iteration.
+// The SEG_CONVERGENCE and SEG_ITERATIONS environment variables override both.
+#define CONVERGENCE 0.001
+
 // A threshold divides which pixels are assigned to which group.
 // A good threshold perfectly partitions the object from the background.
 #define THRESHOLD 0.9
@@ -19,8 +43,160 @@
 // Higher order MRF makes it easier to tell if pixel is near object or not.
 // Image dimension is divided by PARTITION to determine the MRF order.
 // Higher PARTITION means lower MRF ORDER. (PARTITION = SIZE/ORDER)
+// The SEG_PARTITION environment variable overrides it.
 #define PARTITION 60
 
+// Given a latency budget of DEADLINE milliseconds for the Gibbs stage, PARTITION and
+// ITERATIONS become upper bounds: the largest radius and iteration count an estimate of
+// the stage fits in the budget are used instead, and reported. The radius shrinks to
+// half first, then iterations are dropped, then the radius shrinks further. An iteration
+// is estimated at DEADLINE_PIXEL_NS per pixel channel, plus DEADLINE_TAP_NS for each of
+// the 2*radius+1 taps a slide adds, split over the threads. Both were measured end to
+// end on an AVX-512 core. Pyramid runs are not budgeted. SEG_DEADLINE, SEG_DEADLINE_PIXEL_NS and
+// SEG_DEADLINE_TAP_NS override them.
+#define DEADLINE 0 // no budget
+#define DEADLINE_PIXEL_NS 60.0
+#define DEADLINE_TAP_NS   10.0
+
+// Shape of the MRF neighborhood. A DISK holds the taps with l*l + m*m <= order,
+// a SQUARE the whole (2*order+1)^2 window, and an ELLIPSE divides each image
+// dimension by PARTITION separately, so non-square images get an anisotropic one.
+#define STENCIL_DISK    0
+#define STENCIL_SQUARE  1
+#define STENCIL_ELLIPSE 2
+#define STENCIL STENCIL_DISK
+
+// Luminances that no neighbor uses all share one baseline PDF weight, so the Gibbs CDF
+// is a ramp with bumps at the occupied luminances. Neighborhoods with at most this many
+// distinct luminances are thresholded in closed form from those bumps alone, busier
+// ones still build the full 256-entry CDF.
+#define SPARSE_BINS 64
+
+// Busy neighborhoods can also build their CDF from 31-bit fixed-point weights, relative
+// to the weight of their most frequent luminance, and compare it to THRESHOLD of the
+// total in integer arithmetic. Integer lanes are twice as many as double lanes and need no division.
+// With FIXED_POINT_REPORT every such decision is also made in double precision and the
+// number that differ is printed per iteration. SEG_FIXED_POINT and SEG_FIXED_POINT_REPORT
+// override both.
+#define FIXED_POINT 0
+#define FIXED_POINT_REPORT 0
+#define FIXED_THRESHOLD ((unsigned long long) (THRESHOLD * 4294967296.0))
+
+// Busy neighborhoods can also be thresholded by a two-level search: the Gibbs weight of
+// every 16 luminances is kept as a coarse sum, which is only recounted once one of its
+// counts changed. The CDF crossing is located among the 16 coarse sums and then among the
+// 16 luminances of its coarse bin only. It adds the weights in another order than the
+// full CDF, so near-ties may round the other way. SEG_COARSE overrides it.
+#define COARSE 0
+
+// A pixel whose every tap has luminance v thresholds to a value that only depends on v,
+// tabulated once per image. Tiles are checked for FLAT_BLOCK square blocks whose whole
+// stencil bounding box is one luminance per channel; those are filled from the table
+// without counting, the rest of such a tile goes to the tile kernel. SEG_FLAT overrides it.
+#define FLAT 1
+#define FLAT_BLOCK 32
+
+// Rectangular (SQUARE) stencils at least COLUMN_RADIUS wide keep one histogram per column
+// and slide the window by whole column histograms, which costs the same at any radius.
+#define COLUMN_RADIUS 24
+
+// Luminances can be counted in BINS bins of 256/BINS levels each, 32, 64, 128 or 256,
+// which shortens the CDF scan in proportion. The threshold is then the center of the bin
+// the CDF crosses in or, with BIN_REFINE, the level it would cross at were the weight of
+// that bin spread evenly over its levels. The SEG_BINS environment variable overrides BINS.
+#define BINS 256
+#define BIN_REFINE 1
+
+// Every Gibbs iteration only reads img_copy and only writes img_mask, so its rows are
+// split into bands that a pool of worker threads computes in parallel.
+// 0 starts one worker per online core. The SEG_THREADS environment variable overrides it.
+#define THREADS 0
+
+// Bytes of cache one tile of the Gibbs stage may occupy. Bands are cut into tiles whose
+// input, halo included, fits this budget, so the 2*byte_offset+1 rows every pixel reads
+// stay cached while the tile is swept instead of streaming whole image rows.
+#define TILE_CACHE (256*1024)
+
+// Instead of streaming the whole image through memory once per iteration, the iterations
+// can run as a wavefront: iteration h+1 computes a chunk of rows as soon as iteration h
+// finished the rows it reads, so every row is read from memory once and stays cached for
+// all of them. Chunks are sized for the rows in flight to fit WAVEFRONT_CACHE bytes.
+// The iterations then cannot stop early or skip clean pixels. SEG_WAVEFRONT overrides it.
+#define WAVEFRONT 0
+#define WAVEFRONT_CACHE (4*1024*1024)
+
+// Pixels closer to the border than the stencil have no full neighborhood, and NONE leaves
+// them unsegmented, as scalar does. With another policy the Gibbs buffers get a ghost zone
+// of stencil rows and cols around the image and the whole frame is segmented. The ghost
+// zone mirrors the image without repeating its edge (MIRROR), repeats the edge pixels
+// (CLAMP) or holds BORDER_VALUE (CONSTANT). Its rows are also padded to whole cache lines.
+#define BORDER_NONE     0
+#define BORDER_MIRROR   1
+#define BORDER_CLAMP    2
+#define BORDER_CONSTANT 3
+#define BORDER BORDER_NONE
+#define BORDER_VALUE 0
+
+// After the first iteration only the pixels near a change of the previous one can change:
+// the others keep their neighborhood, so they are copied instead of recomputed.
+#define INCREMENTAL 1
+
+// The neighborhood radius grows with the image, so the cost of an iteration grows with
+// the fourth power of its edge. With PYRAMID > 0 the image is first segmented at up to
+// PYRAMID halvings of its size, coarsest first, each level starting from the upsampled
+// result of the one below. The full resolution image then only runs PYRAMID_PASSES
+// iterations. SEG_PYRAMID and SEG_PYRAMID_PASSES override both.
+#define PYRAMID 0
+#define PYRAMID_PASSES 1
+
+// Lay the Gibbs buffers out as one plane per channel instead of interleaved BGR pixels,
+// so the neighbors of a channel are contiguous bytes. The MRF iterations and the BFS
+// run on the planes; the result is interleaved again before it is saved.
+#define PLANAR 0
+
+// The image sized buffers (the bitmap, its copy, the Gibbs frames, the per-pixel maps and
+// the BFS mask) are mapped on 2 MB boundaries, so the many rows a stencil reaches across
+// share few TLB entries. TRANSPARENT asks the kernel to back them with transparent huge
+// pages, EXPLICIT maps them from the hugetlbfs pool and falls back to TRANSPARENT once it
+// is empty, NONE keeps them on the heap. SEG_HUGE_PAGES (0, 1 or 2) overrides it. The dTLB
+// load misses of the Gibbs stage are reported wherever the kernel lets them be counted.
+#define HUGE_PAGES_NONE        0
+#define HUGE_PAGES_TRANSPARENT 1
+#define HUGE_PAGES_EXPLICIT    2
+#define HUGE_PAGES HUGE_PAGES_TRANSPARENT
+#define HUGE_PAGE (2*1024*1024)
+
+// On multi-socket hosts the bands are spread over the NUMA nodes in order, every worker
+// pinned to the CPUs of its node, and every worker first touches the rows of its band in
+// the Gibbs frames before the image is copied in, so those pages live on its node. Only
+// the halo rows at band edges are then read across nodes. Wavefronts split chunks by
+// columns instead and gain nothing from it. The pages must still be untouched then, so
+// it needs HUGE_PAGES mappings: alloc_buffer zeroes a heap fallback on the main thread,
+// which places all of it on that thread's node. SEG_NUMA overrides it.
+#define NUMA 0
+
+// Thumbnails have too small a neighborhood for the stencil walk to amortize its loop and
+// address overhead. Every channel is an independent MRF over the same stencil, so with
+// SEG_BATCH=n the same-sized image0.bmp .. image<n-1>.bmp are stacked channel by channel
+// into one frame of up to MAX_CHANNELS channels and segmented in lockstep. A small
+// stencil gives every channel its own SIMD lane, see LANES; otherwise each tap is read
+// once for the same pixel of every image, and their thresholds are solved back to back.
+// Convergence is still judged image by image, and an image that
+// converged keeps that result while the rest of the batch iterates on, so every image is
+// thresholded exactly as it would be alone. Every image gets its own mask and segmented
+// bitmap, as image<i>_mask.bmp and image<i>.bmp.
+#define BATCH 0
+#define MAX_CHANNELS 48
+
+// A batch whose stencil has at most LANE_TAPS taps is thresholded one stacked channel per
+// SIMD lane: a grayscale image per lane, 8 of them at a time with AVX-512. Every lane sorts
+// its taps instead of sliding a histogram, and solves the threshold as
+// gibbs_threshold_sparse does, so it needs at most SPARSE_BINS taps. Sorting grows faster
+// than sliding with the taps: AVX2, with 4 lanes, only pays off up to LANE_TAPS/2 of them.
+// SEG_LANES=0 turns it off, and without AVX2 the batch is thresholded channel by channel.
+#define LANES 1
+#define LANE_TAPS 32
+
 #pragma pack(push, 1)
 typedef struct
 {
@@ -49,6 +225,93 @@ struct Node //struct used for linked lists
     struct Node *next;
 };
 
+struct Histogram //luminance counts of one channel's Markovian neighbors
+{
+    int *count;                     // 256 >> shift bins, in storage clear_histograms was given
+    int shift;                      // luminances are counted in bins of 1 << shift
+    int distinct;                   // how many luminances have a nonzero count
+    unsigned long long occupied[4]; // bit lum is set while count[lum] > 0
+    unsigned int stale;             // bit b is set once a count of bins 16b..16b+15 changed
+    double coarse[16];              // Gibbs weight of bins 16b..16b+15, unless stale
+    int coarse_peak;                // peak count the coarse weights are relative to
+};
+
+struct Stencil //MRF neighborhood stored as spans, computed once per image
+{
+    int rows, cols;     // half-height and half-width of the bounding box
+    int *mStart, *mEnd; // row l covers columns mStart[l]..mEnd[l], for l = -rows..rows
+    int *lStart, *lEnd; // column m covers rows lStart[m]..lEnd[m], for m = -cols..cols
+    int *offset;        // byte offset of every tap from the center pixel, row by row
+    int taps;
+    int *network;       // compare-exchange pairs that sort the taps, NULL until sort_network
+    int compares;       // pairs in network
+};
+
+struct Frame //layout of the buffers the Gibbs stage and the BFS work on
+{
+    int byte_width;         // bytes from one row to the next, a whole number of cache lines
+    int pixel_stride;       // bytes from one pixel to the next: byte_depth, or 1 when planar
+    int channel_stride;     // bytes from one channel to the next: 1, or a whole plane when planar
+    int pad_rows, pad_cols; // ghost zone around the image
+    int lead;               // bytes from the start of the buffer to pixel (0,0)
+    size_t size;            // bytes of the whole buffer
+};
+
+struct GibbsStage;
+typedef long long (*GibbsTile)(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end);
+
+struct GibbsStage //what one Gibbs iteration reads and writes, shared by all workers
+{
+    GibbsTile       tile;       // tile kernel, specialized for the byte depth and stencil
+    unsigned char  *img_copy;   // input of the iteration
+    unsigned char  *img_mask;   // output of the iteration
+    struct Stencil *stencil;
+    double         *gibbs_weight;
+    int             bin_shift;    // shift of every Histogram of the stage
+    int             coarse;       // threshold busy neighborhoods by the two-level search
+    unsigned char  *flat;         // output of a pixel all of whose taps are v, NULL to always count
+    int            *fixed_weight; // gibbs_weight in fixed point, NULL to threshold in double
+    int             fixed_report; // also threshold in double and count the disagreements
+    long long       fixed_differ; // decisions of this iteration the two disagreed on
+    unsigned char  *dirty;      // pixels to recompute, one byte per pixel, NULL for all of them
+    unsigned char  *moved;      // pixels the iteration changed, one byte per pixel
+    int width, height, byte_width, byte_depth;
+    int pixel_stride, channel_stride;
+    int first_row, last_row;    // the iteration computes rows first_row..last_row-1
+    int first_col, last_col;    // and columns first_col..last_col-1 of them
+    int tile_rows, tile_cols;   // pixels computed per tile, halo excluded
+};
+
+struct Wavefront //all iterations pipelined over chunks of rows, one step at a time
+{
+    struct GibbsStage level[2]; // iteration h reads level[h&1].img_copy, writes its img_mask
+    int chunk_rows, chunks;     // chunk c holds rows first_row+c*chunk_rows on
+    int lag;                    // chunks an iteration stays behind the previous one
+    int iterations, step;       // at step s iteration h computes chunk s - h*lag
+    long long *changed;         // pixel channels every iteration changed
+};
+
+struct WorkerPool //persistent threads that compute the row bands of every iteration
+{
+    struct GibbsStage *stage;
+    struct Wavefront  *wave;    // set while the pool runs a wavefront instead of bands
+    pthread_t         *threads;
+    int               *band;    // worker t computes rows band[t]..band[t+1]-1
+    int                count;   // number of workers, including the main thread
+    long long         *changed; // pixel channels worker t changed in the last iteration
+    int                nodes;   // NUMA nodes the workers are pinned over, 0 when unpinned
+    struct Frame      *frame;   // set while the pool first touches its bands of the frames
+    cpu_set_t          affinity; // of the main thread before it was pinned
+    int                quit;
+    pthread_barrier_t  start, done;
+};
+
+struct Worker
+{
+    struct WorkerPool *pool;
+    int id;
+};
+
 struct timespec diff(struct timespec start, struct timespec end)
 {
   struct timespec temp;
@@ -62,6 +325,8 @@ struct timespec diff(struct timespec start, struct timespec end)
   return temp;
 }
 
+void *alloc_buffer(size_t size);
+
 int load_bitmap(char *filename, BMPINFOHEADER *bmpInfoHeader, unsigned char **img)
 {
     //  1. Open filename in read binary mode
@@ -75,7 +340,7 @@ int load_bitmap(char *filename, BMPINFOHEADER *bmpInfoHeader, unsigned char **im
 
     //  3. malloc for bitmap
     int imgSize = bmpInfoHeader->ImageSize;
-    *img = (unsigned char*) malloc(imgSize*sizeof(unsigned char));
+    *img = (unsigned char*) alloc_buffer(imgSize*sizeof(unsigned char));
     if (*img == NULL) return -2;
 
     //  4. Read the bitmap
@@ -88,6 +353,176 @@ int load_bitmap(char *filename, BMPINFOHEADER *bmpInfoHeader, unsigned char **im
     return 0;
 }
 
+double env_or(char *name, double fallback)
+{
+    //  Numeric setting from the environment, if it is set.
+    char *value = getenv(name);
+    return (value != NULL) ? atof(value) : fallback;
+}
+
+void *alloc_buffer(size_t size)
+{
+    //  Zeroed buffer of size bytes on a cache line, for free_buffer to release.
+    //  The cache line in front of it holds the length of its mapping, 0 if on the heap.
+    int huge_pages = (int) env_or("SEG_HUGE_PAGES", HUGE_PAGES);
+    size_t length = (size + 64 + HUGE_PAGE-1) & ~(size_t) (HUGE_PAGE-1);
+    unsigned char *base = MAP_FAILED;
+    if (huge_pages == HUGE_PAGES_EXPLICIT)
+        base = (unsigned char*) mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED && huge_pages != HUGE_PAGES_NONE)
+    {
+        //  Map a huge page more than needed and trim it to start on a huge page.
+        unsigned char *raw = (unsigned char*) mmap(NULL, length + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED)
+        {
+            base = (unsigned char*) (((uintptr_t) raw + HUGE_PAGE-1) & ~(uintptr_t) (HUGE_PAGE-1));
+            if (base > raw)
+                munmap(raw, base - raw);
+            if (raw + HUGE_PAGE > base)
+                munmap(base + length, raw + HUGE_PAGE - base);
+            madvise(base, length, MADV_HUGEPAGE);
+        }
+    }
+    if (base == MAP_FAILED)
+    {
+        length = 0;
+        base = (unsigned char*) aligned_alloc(64, (size + 64 + 63) & ~(size_t) 63);
+        if (base == NULL)
+            return NULL;
+        memset(base, 0, size + 64);
+    }
+    *(size_t*) base = length;
+    return base + 64;
+}
+
+void free_buffer(void *buffer)
+{
+    unsigned char *base = (unsigned char*) buffer - 64;
+    if (buffer == NULL)
+        return;
+    if (*(size_t*) base)
+        munmap(base, *(size_t*) base);
+    else
+        free(base);
+}
+
+int open_tlb_counter(void)
+{
+    //  Counter of the dTLB load misses of this thread and of the threads it starts from
+    //  now on, or -1 where the kernel does not allow it.
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit        = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int border_index(int x, int size, int border)
+{
+    //  Image coordinate a ghost coordinate x copies under the MIRROR and CLAMP policies.
+    //  Images too small to mirror are clamped.
+    if (border == BORDER_MIRROR && size > 1)
+        while (x < 0 || x >= size)
+            x = (x < 0) ? -x : 2*(size-1) - x;
+    return (x < 0) ? 0 : (x >= size) ? size-1 : x;
+}
+
+void frame_layout(struct Frame *frame, int width, int height, int byte_depth,
+                  int pad_rows, int pad_cols, int planar)
+{
+    //  Rows, and pixel (0,0) within them, start on a cache line. Planes are stacked.
+    //  A last cache line of slack lets a 24-bit pixel be read with one 4-byte load.
+    int pixel_stride = planar ? 1 : byte_depth;
+    int lead_bytes   = (pad_cols*pixel_stride + 63) & ~63;
+    frame->byte_width     = (lead_bytes + (width + pad_cols)*pixel_stride + 63) & ~63;
+    frame->pixel_stride   = pixel_stride;
+    frame->channel_stride = planar ? frame->byte_width*(height + 2*pad_rows) : 1;
+    frame->pad_rows       = pad_rows;
+    frame->pad_cols       = pad_cols;
+    frame->lead           = pad_rows*frame->byte_width + lead_bytes;
+    frame->size           = (size_t) frame->byte_width*(height + 2*pad_rows) * (planar ? byte_depth : 1) + 64;
+}
+
+void to_frame(unsigned char *origin, struct Frame *frame, unsigned char *img,
+              int byte_width, int width, int height, int byte_depth)
+{
+    //  Copy (and de-interleave when planar) a bitmap into a frame whose pixel (0,0) is origin.
+    int x, y, k;
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            for (k = 0; k < byte_depth; k++)
+                origin[y*frame->byte_width + x*frame->pixel_stride + k*frame->channel_stride] =
+                    img[y*byte_width + x*byte_depth + k];
+}
+
+void from_frame(unsigned char *img, int byte_width, unsigned char *origin, struct Frame *frame,
+                int width, int height, int byte_depth)
+{
+    //  Copy (and re-interleave when planar) a frame back into the bitmap layout.
+    int x, y, k;
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            for (k = 0; k < byte_depth; k++)
+                img[y*byte_width + x*byte_depth + k] =
+                    origin[y*frame->byte_width + x*frame->pixel_stride + k*frame->channel_stride];
+}
+
+void fill_border_rows(unsigned char *origin, struct Frame *frame, int width, int height, int byte_depth, int border,
+                      int row_begin, int row_end)
+{
+    //  origin is pixel (0,0) of a frame with a ghost zone of pad_rows and pad_cols on
+    //  every side. The ghost columns of image rows row_begin..row_end-1 are filled first
+    //  and then the whole ghost rows that copy one of them, which takes care of the corners.
+    int x, y, k, p;
+    int byte_width = frame->byte_width, ps = frame->pixel_stride, cs = frame->channel_stride;
+    int pad_rows = frame->pad_rows, pad_cols = frame->pad_cols;
+    int planes = (ps < byte_depth) ? byte_depth : 1, ghost_row = (width + 2*pad_cols) * ps;
+    for (y = row_begin; y < row_end; y++)
+    {
+        unsigned char *row = &origin[y*byte_width];
+        for (x = 1; x <= pad_cols; x++)
+            for (k = 0; k < byte_depth; k++)
+            {
+                row[(-x)*ps + k*cs] = (border == BORDER_CONSTANT) ? BORDER_VALUE :
+                                      row[border_index(-x, width, border)*ps + k*cs];
+                row[(width-1+x)*ps + k*cs] = (border == BORDER_CONSTANT) ? BORDER_VALUE :
+                                      row[border_index(width-1+x, width, border)*ps + k*cs];
+            }
+    }
+    for (p = 0; p < planes; p++)
+        for (y = 1; y <= pad_rows; y++)
+        {
+            unsigned char *plane  = &origin[p*cs - pad_cols*ps];
+            unsigned char *top    = &plane[(-y)*byte_width];
+            unsigned char *bottom = &plane[(height-1+y)*byte_width];
+            int top_source = border_index(-y, height, border), bottom_source = border_index(height-1+y, height, border);
+            if (border == BORDER_CONSTANT)
+            {
+                if (row_begin == 0)
+                    memset(top, BORDER_VALUE, ghost_row);
+                if (row_end == height)
+                    memset(bottom, BORDER_VALUE, ghost_row);
+                continue;
+            }
+            if (top_source >= row_begin && top_source < row_end)
+                memcpy(top, &plane[top_source*byte_width], ghost_row);
+            if (bottom_source >= row_begin && bottom_source < row_end)
+                memcpy(bottom, &plane[bottom_source*byte_width], ghost_row);
+        }
+}
+
+void fill_border(unsigned char *origin, struct Frame *frame, int width, int height, int byte_depth, int border)
+{
+    fill_border_rows(origin, frame, width, height, byte_depth, border, 0, height);
+}
+
 int overwrite_bitmap(char *filename, unsigned char **img)
 {
     //  1. Open filename in "R/W binary at beginning" mode
@@ -111,186 +546,2025 @@ int overwrite_bitmap(char *filename, unsigned char **img)
     return 0;
 }
 
-int main(){
-
-    //  0. Initialize timestamp calculator
-    struct timespec time1, time2, result;
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
-
-    //  1. Load bitmap
-    char          *img_name = "image.bmp";
-    char          *img_mask_name = "image_mask.bmp";
-    BMPINFOHEADER  img_info;
-    unsigned char *img;
-    int status = load_bitmap(img_name, &img_info, &img);
-    if (status == -1) {
-        printf("ERROR: 1. File DNE\n");
-        return 0;
-    } else if (status == -2){
-        printf("ERROR: 2. Could not allocate memory\n");
-        return 0;
-    } else if (status != 0) {
-        printf("ERROR: 3. Only read %d bytes\n", status);
-        return 0;
+void build_stencil(struct Stencil *stencil, int shape, int rows, int cols, int byte_width, int byte_depth)
+{
+    //  All shapes are convex, so every row and every column of taps is one span.
+    //  An ellipse with radii rows, cols holds l*l*cols*cols + m*m*rows*rows <= (rows*cols)^2.
+    long long r2 = (long long) rows*rows, c2 = (long long) cols*cols;
+    int l, m, n = 0;
+    stencil->rows   = rows;
+    stencil->cols   = cols;
+    stencil->mStart = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+    stencil->mEnd   = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+    stencil->lStart = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+    stencil->lEnd   = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+    stencil->taps   = 0;
+    stencil->network  = NULL;
+    stencil->compares = 0;
+    for (m = -cols; m <= cols; m++)
+    {
+        stencil->lStart[m] = rows + 1;
+        stencil->lEnd[m]   = -rows - 1;
+    }
+    for (l = -rows; l <= rows; l++)
+    {
+        int span = cols;
+        if (shape != STENCIL_SQUARE)
+            for (span = 0; span < cols && l*l*c2 + (span+1)*(span+1)*r2 <= r2*c2; span++);
+        stencil->mStart[l] = -span;
+        stencil->mEnd[l]   =  span;
+        stencil->taps     += 2*span + 1;
+        for (m = -span; m <= span; m++)
+        {
+            if (stencil->lStart[m] > l) stencil->lStart[m] = l;
+            if (stencil->lEnd[m]   < l) stencil->lEnd[m]   = l;
+        }
     }
 
-    //  2. Copy the original image in a separate buffer and leave the original untouched.
-    unsigned char *img_copy = (unsigned char*) malloc(img_info.ImageSize);
-    unsigned char *img_mask = (unsigned char*) malloc(img_info.ImageSize);
-    int g;
-    for (g = 0; g < img_info.ImageSize; g++)
-        img_mask[g] = img[g];
+    stencil->offset = (int*) malloc(stencil->taps * sizeof(int));
+    for (l = -rows; l <= rows; l++)
+        for (m = stencil->mStart[l]; m <= stencil->mEnd[l]; m++)
+            stencil->offset[n++] = l*byte_width + m*byte_depth;
+}
 
-    //  3. Relate image areas by thresholding PDF of Markovian Gibbs Probability
-    //    (Refer to: Image Prediction)
-    /*
-        These are some variable descriptions. 
-        It'll be easier to understand if you read Bitmap Wikipedia.
+void free_stencil(struct Stencil *stencil)
+{
+    free(stencil->mStart - stencil->rows);
+    free(stencil->mEnd   - stencil->rows);
+    free(stencil->lStart - stencil->cols);
+    free(stencil->lEnd   - stencil->cols);
+    free(stencil->offset);
+    free(stencil->network);
+}
 
-        byte_depth  : how many bytes are per pixel.
-        byte_padd   : how many bytes used to align the xs by 4 bytes
-        byte_width  : how many bytes are per x INCLUDING the padding
-        byte_offset : the radius that bounds what pixels are considered neighbors in MRF
-    */
-    int byte_depth  = img_info.bitPerPix / 8;
-    int byte_padd   = (4 - img_info.Width * byte_depth & 0x3) & 0x3;
-    int byte_width  = img_info.Width * byte_depth + byte_padd;
-    int byte_offset = (img_info.Width < img_info.Height) ? 
-                        img_info.Width/PARTITION : img_info.Height/PARTITION;
-    int h, i, j, k;
-    for (h = 0; h < ITERATIONS; h++)
+void sort_network(struct Stencil *stencil)
+{
+    //  Batcher's odd-even merge sort of the taps, as pairs (a,b) after which tap a holds
+    //  the smaller luminance and tap b the larger. The first pass counts the pairs.
+    int n = stencil->taps, pass, p, k, j, i, pairs = 0;
+    for (pass = 0; pass < 2; pass++)
     {
-        //  In the beginning of every iteration:
-        //      img_copy is the one that was iterated,
-        //      img_mask is the result of iteration.
-        //  Data always flows from img_copy -> img_mask.
-        //  Switch these two to modify the content of img_mask again.
-        unsigned char *img_to_modify = img_mask;
-        img_mask = img_copy;
-        img_copy = img_to_modify;
-
-        for (i = byte_offset; i < img_info.Height-byte_offset; i++)
-            for (j = byte_offset; j < img_info.Width-byte_offset; j++)
-                for (k = 0; k < byte_depth; k++)
-                {
-                    // Initialize Gibbs CDF array
-                    double gibbs_CDF[257];      // Gibbs PDF for this pixel (i,j)'s
-                                                // luminance to be 0,1...255 or lower 
-                                                // based on Markovian neighbor values.
-                           gibbs_CDF[0] = 0;    // The first element is for making CDF 
-                                                // generation easier by having an index 0
-                                                // for lum -1, whose gibbs_PDF is 0.
-                    int lum, order = byte_offset*byte_offset;
-                    for (lum = 0; lum <= 255; lum++) ///////////////// Optimizable
-                        gibbs_CDF[lum+1] = order << 2;
-
-                    // Calculate Equipotential of each luminance using Markovian Neighbors
-                    int l, m;
-                    for (l = -byte_offset; l <= byte_offset; l++)
-                        for (m = -byte_offset; m <= byte_offset; m++)
+        if (pass)
+            stencil->network = (int*) malloc((2*pairs + 1) * sizeof(int));
+        stencil->compares = pairs, pairs = 0;
+        for (p = 1; p < n; p *= 2)
+            for (k = p; k >= 1; k /= 2)
+                for (j = k % p; j + k < n; j += 2*k)
+                    for (i = 0; i < k && i+j+k < n; i++)
+                        if ((i+j) / (2*p) == (i+j+k) / (2*p))
                         {
-                            int lum = img_copy[(i+l)*byte_width + (j+m)*byte_depth + k] + 1;
-                            gibbs_CDF[lum] -= (l*l + m*m <= order) ? 5 : 0;
+                            if (pass)
+                            {
+                                stencil->network[2*pairs]   = i+j;
+                                stencil->network[2*pairs+1] = i+j+k;
+                            }
+                            pairs++;
                         }
+    }
+}
 
-                    // Generate CDF
-                    for (lum = 0; lum <= 255; lum++)
-                        gibbs_CDF[lum+1] = gibbs_CDF[lum] + exp(-gibbs_CDF[lum+1]/TEMPERATURE);
+static inline __attribute__((always_inline))
+void add_luminance(struct Histogram *hist, int lum, int weight)
+{
+    //  Count (or uncount, with weight -1) one luminance of one channel.
+    //  A luminance toggles its occupied bit when its count leaves or returns to 0.
+    lum >>= hist->shift;
+    int count = hist->count[lum] += weight;
+    hist->stale |= 1u << (lum >> 4);
+    if (count == (weight > 0))
+    {
+        hist->occupied[lum >> 6] ^= 1ULL << (lum & 63);
+        hist->distinct += weight;
+    }
+}
 
-                    // Threshold CDF
-                    for (lum = 0; lum <= 255; lum++)
-                        if (gibbs_CDF[lum+1]/gibbs_CDF[256] > THRESHOLD)
-                        {
-                            img_mask[i*byte_width+j*byte_depth+k] = (unsigned char) lum;
-                            lum = 256;
-                        }
-                }
-        printf("Iteration %d done.\n", h+1);
+static inline __attribute__((always_inline))
+void add_neighbor(struct Histogram *hist, unsigned char *pixel, int byte_depth, int channel_stride, int weight)
+{
+    //  Count (or uncount, with weight -1) every channel of one neighbor pixel.
+    //  Interleaved 24 and 32-bit pixels are read with a single load and split in registers.
+    int k;
+    if (!PLANAR && (byte_depth == 3 || byte_depth == 4))
+    {
+        unsigned int channels;
+        memcpy(&channels, pixel, 4);
+        for (k = 0; k < byte_depth; k++)
+            add_luminance(&hist[k], (channels >> 8*k) & 255, weight);
+        return;
     }
+    for (k = 0; k < byte_depth; k++)
+        add_luminance(&hist[k], pixel[k*channel_stride], weight);
+}
 
-    //  4. Save thresholded MRF image
-    status = overwrite_bitmap(img_mask_name, &img_mask);
-    if (status == -1) {
-        printf("ERROR: 6. Could not open file\n");
-        return 0;
-    } else if (status != 0) {
-        printf("ERROR: 7. Only wrote %d bytes\n", status);
-        return 0;
+int bin_level(struct Histogram *hist, int bin, double before, double after, double target)
+{
+    //  Output luminance of the bin whose CDF went from before to after, across target.
+    int width = 1 << hist->shift;
+    if (hist->shift == 0)
+        return bin;
+    if (!BIN_REFINE)
+        return (bin << hist->shift) + width/2;
+    int level = (int) ((target - before) / (after - before) * width);
+    return (bin << hist->shift) + ((level < 0) ? 0 : (level >= width) ? width-1 : level);
+}
+
+__attribute__((target("avx512f")))
+int gibbs_threshold_dense_avx512(struct Histogram *hist, double *gibbs_weight)
+{
+    //  gibbs_threshold_dense_scalar for AVX-512 hosts.
+    int lum, bins = 256 >> hist->shift;
+    double gibbs_CDF[bins] __attribute__((aligned(64)));
+
+    //  Generate CDF 8 luminances at a time: gather their Gibbs weights, prefix-sum
+    //  them in-register with three shifted adds and add the running total.
+    __m512d carry = _mm512_setzero_pd();
+    __m512i top   = _mm512_setzero_si512();
+    for (lum = 0; lum < bins; lum += 16)
+        top = _mm512_max_epi32(top, _mm512_loadu_si512(&hist->count[lum]));
+    __m256i peak = _mm256_set1_epi32(_mm512_reduce_max_epi32(top));
+    for (lum = 0; lum < bins; lum += 8)
+    {
+        __m256i shortfall = _mm256_sub_epi32(peak, _mm256_loadu_si256((__m256i*) &hist->count[lum]));
+        __m512d cdf = _mm512_i32gather_pd(shortfall, gibbs_weight, 8);
+        cdf = _mm512_add_pd(cdf, _mm512_maskz_permutexvar_pd(0xFE, _mm512_set_epi64(6,5,4,3,2,1,0,0), cdf));
+        cdf = _mm512_add_pd(cdf, _mm512_maskz_permutexvar_pd(0xFC, _mm512_set_epi64(5,4,3,2,1,0,0,0), cdf));
+        cdf = _mm512_add_pd(cdf, _mm512_maskz_permutexvar_pd(0xF0, _mm512_set_epi64(3,2,1,0,0,0,0,0), cdf));
+        cdf = _mm512_add_pd(cdf, carry);
+        _mm512_store_pd(&gibbs_CDF[lum], cdf);
+        carry = _mm512_permutexvar_pd(_mm512_set1_epi64(7), cdf);
     }
-    
-    //  5. Produce Mask from Thresholded MRF using BFS
-    int midX = img_info.Height / 2;
-    int midY = img_info.Width  / 2;
-    unsigned char *center   = &img_mask[midX * byte_width + midY * byte_depth];
-    unsigned char *BFSArray = (unsigned char*) calloc(img_info.ImageSize, 1);
-    struct Node   *visiting = (struct Node*) malloc(sizeof(struct Node));
-          visiting->row     = midX;
-          visiting->column  = midY;
-          visiting->next    = NULL;
-    struct Node *last_in_queue  = visiting;
-    while (visiting != NULL) 
+
+    //  Threshold CDF: first luminance above THRESHOLD of the total, 8 compares at a time
+    double  crossing = THRESHOLD * gibbs_CDF[bins-1];
+    __m512d target   = _mm512_set1_pd(crossing);
+    for (lum = 0; lum < bins; lum += 8)
     {
-        //  Check all 4 vertical and horizontal neighbors.
-        int past_col=-1, col=-1, row=0;
-        for (i=0; i<4; i++, past_col=col, col=row*-1, row=past_col)
+        __mmask8 above = _mm512_cmp_pd_mask(_mm512_load_pd(&gibbs_CDF[lum]), target, _CMP_GT_OQ);
+        if (above)
         {
-            //  Index of the neighbor
-            int x = visiting->row+row;
-            int y = visiting->column+col;
+            lum += __builtin_ctz(above);
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], crossing);
+        }
+    }
+    return -1;
+}
 
-            //  Tests
-            // 1. The visiting struct Node is always "valid (has 1 same RGB as center)"
-            // 2. If neighbor is not valid, move on. If "valid" and unvisited, mark valid and add to queue
-            // 3. On mask, 0 is unvisited, 1 is valid
-            if ((x|y) < 0 || x >= img_info.Height || y >= img_info.Width) //  Boundary check
-                continue;
-            if (BFSArray[x*byte_width + y*byte_depth]) //  If already marked valid, don't check again
-                continue;
-            for (j = 0; j < byte_depth; j++)
-                j = (img_mask[x*byte_width + y*byte_depth + j] == center[j]) ? byte_depth+1 : j;
-            if (j < byte_depth+1)
-                continue;
+__attribute__((target("avx2")))
+int gibbs_threshold_dense_avx2(struct Histogram *hist, double *gibbs_weight)
+{
+    //  gibbs_threshold_dense_scalar for AVX2 hosts.
+    int lum, bins = 256 >> hist->shift;
+    double gibbs_CDF[bins] __attribute__((aligned(64)));
 
-            //  The pixel is valid. Mark as valid and add to queue.
-            for (j = 0; j < byte_depth; j++)
-                BFSArray[x*byte_width + y*byte_depth + j] = 1;
+    //  Generate CDF 4 luminances at a time: gather their Gibbs weights, prefix-sum
+    //  them in-register with two shifted adds and add the running total.
+    __m256d carry = _mm256_setzero_pd(), zero = _mm256_setzero_pd();
+    __m256i top   = _mm256_setzero_si256();
+    for (lum = 0; lum < bins; lum += 8)
+        top = _mm256_max_epi32(top, _mm256_loadu_si256((__m256i*) &hist->count[lum]));
+    top = _mm256_max_epi32(top, _mm256_permute2x128_si256(top, top, 1));
+    top = _mm256_max_epi32(top, _mm256_shuffle_epi32(top, _MM_SHUFFLE(1,0,3,2)));
+    top = _mm256_max_epi32(top, _mm256_shuffle_epi32(top, _MM_SHUFFLE(2,3,0,1)));
+    __m128i peak = _mm256_castsi256_si128(top);
+    for (lum = 0; lum < bins; lum += 4)
+    {
+        __m128i shortfall = _mm_sub_epi32(peak, _mm_loadu_si128((__m128i*) &hist->count[lum]));
+        __m256d cdf = _mm256_i32gather_pd(gibbs_weight, shortfall, 8);
+        cdf = _mm256_add_pd(cdf, _mm256_blend_pd(_mm256_permute4x64_pd(cdf, _MM_SHUFFLE(2,1,0,0)), zero, 0x1));
+        cdf = _mm256_add_pd(cdf, _mm256_blend_pd(_mm256_permute4x64_pd(cdf, _MM_SHUFFLE(1,0,0,0)), zero, 0x3));
+        cdf = _mm256_add_pd(cdf, carry);
+        _mm256_store_pd(&gibbs_CDF[lum], cdf);
+        carry = _mm256_permute4x64_pd(cdf, _MM_SHUFFLE(3,3,3,3));
+    }
 
-            last_in_queue->next = (struct Node*) malloc(sizeof(struct Node));
-            last_in_queue       = last_in_queue->next;
+    //  Threshold CDF: first luminance above THRESHOLD of the total, 4 compares at a time
+    double  crossing = THRESHOLD * gibbs_CDF[bins-1];
+    __m256d target   = _mm256_set1_pd(crossing);
+    for (lum = 0; lum < bins; lum += 4)
+    {
+        int above = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(&gibbs_CDF[lum]), target, _CMP_GT_OQ));
+        if (above)
+        {
+            lum += __builtin_ctz(above);
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], crossing);
+        }
+    }
+    return -1;
+}
 
-            last_in_queue->row    = x;
-            last_in_queue->column = y;
-            last_in_queue->next   = NULL;
+int gibbs_threshold_dense_scalar(struct Histogram *hist, double *gibbs_weight)
+{
+    //  Gibbs CDF for this pixel (i,j)'s luminance to be 0,1...255 or lower
+    //  based on Markovian neighbor values. gibbs_CDF[lum] includes lum itself.
+    //  gibbs_weight is indexed by how many counts a luminance is short of the most
+    //  frequent one. The threshold is compared as THRESHOLD of the total, as the
+    //  vector kernels do.
+    int lum, peak, bins = 256 >> hist->shift;
+    double gibbs_CDF[bins] __attribute__((aligned(64)));
+
+    // Generate CDF from the Gibbs weight of each luminance's shortfall
+    double total = 0;
+    for (peak = 0, lum = 0; lum < bins; lum++)
+        peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+    for (lum = 0; lum < bins; lum++)
+        gibbs_CDF[lum] = total += gibbs_weight[peak - hist->count[lum]];
+
+    // Threshold CDF
+    double target = THRESHOLD * total;
+    for (lum = 0; lum < bins; lum++)
+        if (gibbs_CDF[lum] > target)
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], target);
+    return -1;
+}
+
+__attribute__((target("avx512f")))
+int gibbs_threshold_fixed_avx512(struct Histogram *hist, int *fixed_weight)
+{
+    //  gibbs_threshold_fixed_scalar for AVX-512 hosts.
+    int lum, target, bins = 256 >> hist->shift;
+    int gibbs_CDF[bins] __attribute__((aligned(64)));
+
+    //  Generate CDF 16 luminances at a time with four shifted adds.
+    __m512i carry = _mm512_setzero_si512(), zero = _mm512_setzero_si512(), top = zero;
+    for (lum = 0; lum < bins; lum += 16)
+        top = _mm512_max_epi32(top, _mm512_loadu_si512(&hist->count[lum]));
+    __m512i most = _mm512_set1_epi32(_mm512_reduce_max_epi32(top));
+    for (lum = 0; lum < bins; lum += 16)
+    {
+        __m512i shortfall = _mm512_sub_epi32(most, _mm512_loadu_si512(&hist->count[lum]));
+        __m512i cdf = _mm512_i32gather_epi32(shortfall, fixed_weight, 4);
+        cdf = _mm512_add_epi32(cdf, _mm512_alignr_epi32(cdf, zero, 15));
+        cdf = _mm512_add_epi32(cdf, _mm512_alignr_epi32(cdf, zero, 14));
+        cdf = _mm512_add_epi32(cdf, _mm512_alignr_epi32(cdf, zero, 12));
+        cdf = _mm512_add_epi32(cdf, _mm512_alignr_epi32(cdf, zero, 8));
+        cdf = _mm512_add_epi32(cdf, carry);
+        _mm512_store_si512(&gibbs_CDF[lum], cdf);
+        carry = _mm512_permutexvar_epi32(_mm512_set1_epi32(15), cdf);
+    }
+
+    //  Threshold CDF, 16 compares at a time
+    target = (int) (((unsigned long long) gibbs_CDF[bins-1] * FIXED_THRESHOLD) >> 32);
+    __m512i above_target = _mm512_set1_epi32(target);
+    for (lum = 0; lum < bins; lum += 16)
+    {
+        __mmask16 above = _mm512_cmpgt_epi32_mask(_mm512_load_si512(&gibbs_CDF[lum]), above_target);
+        if (above)
+        {
+            lum += __builtin_ctz(above);
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], target);
         }
-       
-        struct Node *to_visit = visiting->next;
-        free(visiting);
-        visiting = to_visit; //free struct Node and move on to the next on the list
     }
+    return -1;
+}
 
-    //  6. Apply mask to image
-    for (g = 0; g < img_info.ImageSize; g++)
-        img[g] *= BFSArray[g];
+__attribute__((target("avx2")))
+int gibbs_threshold_fixed_avx2(struct Histogram *hist, int *fixed_weight)
+{
+    //  gibbs_threshold_fixed_scalar for AVX2 hosts.
+    int lum, target, bins = 256 >> hist->shift;
+    int gibbs_CDF[bins] __attribute__((aligned(64)));
 
-    //  7. Calculate code duration
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
-    result = diff(time1, time2);
-    long int code_duration = 1000000000 * result.tv_sec + result.tv_nsec;
-    printf("\n::: Duration: %ldns\n\n", code_duration);
-    
-    //  8. Save segmented image
-    status = overwrite_bitmap(img_name, &img);
-    if (status == -1) {
-        printf("ERROR: 4. Could not open file\n");
-        return 0;
-    } else if (status != 0) {
-        printf("ERROR: 5. Only wrote %d bytes\n", status);
-        return 0;
+    //  Generate CDF 8 luminances at a time: prefix-sum each 128-bit half with two
+    //  shifted adds, then carry the lower half's total into the upper half.
+    __m256i carry = _mm256_setzero_si256(), zero = _mm256_setzero_si256(), top = zero;
+    for (lum = 0; lum < bins; lum += 8)
+        top = _mm256_max_epi32(top, _mm256_loadu_si256((__m256i*) &hist->count[lum]));
+    top = _mm256_max_epi32(top, _mm256_permute2x128_si256(top, top, 1));
+    top = _mm256_max_epi32(top, _mm256_shuffle_epi32(top, _MM_SHUFFLE(1,0,3,2)));
+    top = _mm256_max_epi32(top, _mm256_shuffle_epi32(top, _MM_SHUFFLE(2,3,0,1)));
+    for (lum = 0; lum < bins; lum += 8)
+    {
+        __m256i shortfall = _mm256_sub_epi32(top, _mm256_loadu_si256((__m256i*) &hist->count[lum]));
+        __m256i cdf = _mm256_i32gather_epi32(fixed_weight, shortfall, 4);
+        cdf = _mm256_add_epi32(cdf, _mm256_slli_si256(cdf, 4));
+        cdf = _mm256_add_epi32(cdf, _mm256_slli_si256(cdf, 8));
+        cdf = _mm256_add_epi32(cdf, _mm256_blend_epi32(zero, _mm256_permutevar8x32_epi32(cdf, _mm256_set1_epi32(3)), 0xF0));
+        cdf = _mm256_add_epi32(cdf, carry);
+        _mm256_store_si256((__m256i*) &gibbs_CDF[lum], cdf);
+        carry = _mm256_permutevar8x32_epi32(cdf, _mm256_set1_epi32(7));
     }
 
-    free(img);
-    free(img_mask);
-    free(img_copy);
-    free(BFSArray);
-    return 0;
-}
\ No newline at end of file
+    //  Threshold CDF, 8 compares at a time
+    target = (int) (((unsigned long long) gibbs_CDF[bins-1] * FIXED_THRESHOLD) >> 32);
+    __m256i above_target = _mm256_set1_epi32(target);
+    for (lum = 0; lum < bins; lum += 8)
+    {
+        int above = _mm256_movemask_ps(_mm256_castsi256_ps(
+                        _mm256_cmpgt_epi32(_mm256_load_si256((__m256i*) &gibbs_CDF[lum]), above_target)));
+        if (above)
+        {
+            lum += __builtin_ctz(above);
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], target);
+        }
+    }
+    return -1;
+}
+
+int gibbs_threshold_fixed_scalar(struct Histogram *hist, int *fixed_weight)
+{
+    //  Same CDF as gibbs_threshold_dense_scalar, in fixed point: fixed_weight is indexed by
+    //  how many counts a luminance is short of the most frequent one, like gibbs_weight.
+    //  256 of its entries at most still fit in 31 bits.
+    //  The threshold is a 32-bit fraction of the total.
+    int lum, peak, target, bins = 256 >> hist->shift;
+    int gibbs_CDF[bins] __attribute__((aligned(64)));
+
+    // Generate CDF from the fixed-point weight of each luminance's shortfall
+    int total = 0;
+    for (peak = 0, lum = 0; lum < bins; lum++)
+        peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+    for (lum = 0; lum < bins; lum++)
+        gibbs_CDF[lum] = total += fixed_weight[peak - hist->count[lum]];
+
+    // Threshold CDF
+    target = (int) (((unsigned long long) total * FIXED_THRESHOLD) >> 32);
+    for (lum = 0; lum < bins; lum++)
+        if (gibbs_CDF[lum] > target)
+            return bin_level(hist, lum, lum ? gibbs_CDF[lum-1] : 0, gibbs_CDF[lum], target);
+    return -1;
+}
+
+int gibbs_threshold_coarse(struct Histogram *hist, double *gibbs_weight)
+{
+    //  Two-level search over 16 coarse bins of 16 bins each: find the coarse bin the CDF
+    //  crosses in from the coarse sums, then only scan its bins. A coarse sum is only
+    //  recounted once one of its counts changed, which a slide does to few of them, or
+    //  once the peak count its weights are relative to changed.
+    int bins = 256 >> hist->shift, coarse_bins = bins >> 4, coarse, lum, peak;
+    double total = 0, before = 0, after;
+    unsigned int stale;
+    for (peak = 0, lum = 0; lum < bins; lum++)
+        peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+    if (peak != hist->coarse_peak)
+    {
+        hist->stale = (1u << coarse_bins) - 1;
+        hist->coarse_peak = peak;
+    }
+    for (stale = hist->stale; stale; stale &= stale - 1)
+    {
+        coarse = __builtin_ctz(stale);
+        double sum = 0;
+        for (lum = coarse << 4; lum < (coarse+1) << 4; lum++)
+            sum += gibbs_weight[peak - hist->count[lum]];
+        hist->coarse[coarse] = sum;
+    }
+    hist->stale = 0;
+    for (coarse = 0; coarse < coarse_bins; coarse++)
+        total += hist->coarse[coarse];
+
+    double target = THRESHOLD * total;
+    if (total < DBL_MIN) // THRESHOLD of a denormal total may round to all of it
+        return -1;
+    for (coarse = 0; coarse < coarse_bins-1 && before + hist->coarse[coarse] <= target; coarse++)
+        before += hist->coarse[coarse];
+    int crossed = (before + hist->coarse[coarse] > target);
+    for (lum = coarse << 4; lum < (coarse+1) << 4; lum++, before = after)
+        if ((after = before + gibbs_weight[peak - hist->count[lum]]) > target)
+            return bin_level(hist, lum, before, after, target);
+
+    //  The scan adds the weights in another order than the coarse sums did, and may round
+    //  just short of the target they crossed: the crossing is then at the coarse bin's end.
+    //  A search that only stopped at the last coarse bin found no crossing.
+    return crossed ? (((coarse+1) << 4) << hist->shift) - 1 : -1;
+}
+
+int gibbs_threshold_sparse(struct Histogram *hist, double *gibbs_weight)
+{
+    //  With the baseline weight w0 of an unused luminance, the CDF up to lum is
+    //  (lum+1)*w0 plus the excess weight of the occupied luminances <= lum.
+    //  Only the occupied luminances, taken in ascending order from the bitmap, are visited.
+    //  An unused luminance is as many counts short of the most frequent one as it has.
+    //  A crossing on a ramp is measured in luminances, so its fraction is in ramp itself.
+    double w0, excess = 0, target, before, ramp;
+    int word, lum, peak = 0, next = 0, bins = 256 >> hist->shift;
+    unsigned long long bits;
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+        {
+            lum  = (word << 6) + __builtin_ctzll(bits);
+            peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+        }
+    w0 = gibbs_weight[peak];
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+            excess += gibbs_weight[peak - hist->count[(word << 6) + __builtin_ctzll(bits)]] - w0;
+    target = THRESHOLD * (bins*w0 + excess);
+
+    excess = 0;
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+        {
+            lum = (word << 6) + __builtin_ctzll(bits);
+
+            //  First crossing on the ramp of unused luminances next..lum-1
+            ramp = (target - excess) / w0;
+            if (ramp < lum)
+                return (ramp < next) ? bin_level(hist, next, next, next+1, next) :
+                                       bin_level(hist, (int) ramp, (int) ramp, (int) ramp + 1, ramp);
+
+            //  Crossing at the occupied luminance itself
+            before  = lum*w0 + excess;
+            excess += gibbs_weight[peak - hist->count[lum]] - w0;
+            if ((lum+1)*w0 + excess > target)
+                return bin_level(hist, lum, before, (lum+1)*w0 + excess, target);
+            next = lum + 1;
+        }
+
+    //  Crossing on the ramp after the last occupied luminance
+    ramp = (target - excess) / w0;
+    if (ramp < bins)
+        return (ramp < next) ? bin_level(hist, next, next, next+1, next) :
+                               bin_level(hist, (int) ramp, (int) ramp, (int) ramp + 1, ramp);
+    return bin_level(hist, bins-1, 0, 1, 1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void apply_mask_avx512(unsigned char *img, unsigned char *mask, int size)
+{
+    //  img[g] *= mask[g] for a mask of 0s and 1s, 64 bytes at a time.
+    int g;
+    for (g = 0; g+64 <= size; g += 64)
+    {
+        __m512i keep = _mm512_loadu_si512(&mask[g]);
+        _mm512_storeu_si512(&img[g], _mm512_maskz_mov_epi8(_mm512_test_epi8_mask(keep, keep),
+                                                           _mm512_loadu_si512(&img[g])));
+    }
+    for (; g < size; g++)
+        img[g] *= mask[g];
+}
+
+__attribute__((target("avx2")))
+void apply_mask_avx2(unsigned char *img, unsigned char *mask, int size)
+{
+    //  img[g] *= mask[g] for a mask of 0s and 1s, 32 bytes at a time: 0-1 is all ones.
+    int g;
+    for (g = 0; g+32 <= size; g += 32)
+    {
+        __m256i keep = _mm256_sub_epi8(_mm256_setzero_si256(), _mm256_loadu_si256((__m256i*) &mask[g]));
+        _mm256_storeu_si256((__m256i*) &img[g], _mm256_and_si256(keep, _mm256_loadu_si256((__m256i*) &img[g])));
+    }
+    for (; g < size; g++)
+        img[g] *= mask[g];
+}
+
+__attribute__((target("sse4.2")))
+void apply_mask_sse42(unsigned char *img, unsigned char *mask, int size)
+{
+    //  img[g] *= mask[g] for a mask of 0s and 1s, 16 bytes at a time: 0-1 is all ones.
+    int g;
+    for (g = 0; g+16 <= size; g += 16)
+    {
+        __m128i keep = _mm_sub_epi8(_mm_setzero_si128(), _mm_loadu_si128((__m128i*) &mask[g]));
+        _mm_storeu_si128((__m128i*) &img[g], _mm_and_si128(keep, _mm_loadu_si128((__m128i*) &img[g])));
+    }
+    for (; g < size; g++)
+        img[g] *= mask[g];
+}
+
+void apply_mask_scalar(unsigned char *img, unsigned char *mask, int size)
+{
+    int g;
+    for (g = 0; g < size; g++)
+        img[g] *= mask[g];
+}
+
+__attribute__((target("avx512f")))
+void slide_columns_avx512(struct Histogram *hist, int *enter, int *leave, int bins)
+{
+    //  slide_columns_scalar, 16 bins at a time. Nonzero lanes are the occupied bits.
+    int bin;
+    hist->occupied[0] = hist->occupied[1] = hist->occupied[2] = hist->occupied[3] = 0;
+    for (bin = 0; bin < bins; bin += 16)
+    {
+        __m512i count = _mm512_sub_epi32(_mm512_add_epi32(_mm512_loadu_si512(&hist->count[bin]),
+                                                          _mm512_loadu_si512(&enter[bin])),
+                                         _mm512_loadu_si512(&leave[bin]));
+        _mm512_storeu_si512(&hist->count[bin], count);
+        hist->occupied[bin >> 6] |= (unsigned long long) _mm512_test_epi32_mask(count, count) << (bin & 63);
+    }
+    hist->distinct = __builtin_popcountll(hist->occupied[0]) + __builtin_popcountll(hist->occupied[1]) +
+                     __builtin_popcountll(hist->occupied[2]) + __builtin_popcountll(hist->occupied[3]);
+}
+
+__attribute__((target("avx2,popcnt")))
+void slide_columns_avx2(struct Histogram *hist, int *enter, int *leave, int bins)
+{
+    //  slide_columns_scalar, 8 bins at a time. Lanes equal to zero are the free bits.
+    int bin;
+    __m256i zero = _mm256_setzero_si256();
+    hist->occupied[0] = hist->occupied[1] = hist->occupied[2] = hist->occupied[3] = 0;
+    for (bin = 0; bin < bins; bin += 8)
+    {
+        __m256i count = _mm256_sub_epi32(_mm256_add_epi32(_mm256_loadu_si256((__m256i*) &hist->count[bin]),
+                                                          _mm256_loadu_si256((__m256i*) &enter[bin])),
+                                         _mm256_loadu_si256((__m256i*) &leave[bin]));
+        _mm256_storeu_si256((__m256i*) &hist->count[bin], count);
+        unsigned long long empty = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(count, zero)));
+        hist->occupied[bin >> 6] |= (empty ^ 0xFF) << (bin & 63);
+    }
+    hist->distinct = __builtin_popcountll(hist->occupied[0]) + __builtin_popcountll(hist->occupied[1]) +
+                     __builtin_popcountll(hist->occupied[2]) + __builtin_popcountll(hist->occupied[3]);
+}
+
+void slide_columns_scalar(struct Histogram *hist, int *enter, int *leave, int bins)
+{
+    //  Add the column histogram enter to hist and subtract leave, then recount which
+    //  bins are occupied.
+    int bin;
+    hist->occupied[0] = hist->occupied[1] = hist->occupied[2] = hist->occupied[3] = 0;
+    hist->distinct = 0;
+    for (bin = 0; bin < bins; bin++)
+    {
+        hist->count[bin] += enter[bin] - leave[bin];
+        if (hist->count[bin])
+        {
+            hist->occupied[bin >> 6] |= 1ULL << (bin & 63);
+            hist->distinct++;
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx2"), optimize("fp-contract=off")))
+int gibbs_threshold_lanes_avx512(struct GibbsStage *stage, unsigned char *in, unsigned char *out)
+{
+    //  gibbs_threshold_sparse for 8 stacked channels of a pixel at a time, one per lane.
+    //  Every lane sorts its taps by the stencil's network: the runs of equal luminances
+    //  are then its occupied luminances in ascending order, their lengths the counts.
+    //  Both loops of the solver walk the taps, and a lane only takes the ones starting a
+    //  run. Multiplies and adds are not fused, so every lane rounds as the solver does.
+    struct Stencil *stencil = stage->stencil;
+    int taps = stencil->taps, *offset = stencil->offset, *network = stencil->network;
+    int c, t, x, moved = 0, level[8];
+    double *gibbs_weight = stage->gibbs_weight;
+    __m256i  lum[LANE_TAPS], run[LANE_TAPS];
+    __m512d  gain[LANE_TAPS];
+    __mmask8 start[LANE_TAPS];
+    __m256i  one = _mm256_set1_epi32(1);
+    for (c = 0; c < stage->byte_depth; c += 8)
+    {
+        //  Channels c..c+7. Lanes past the last channel read the bytes after it and are
+        //  dropped; the frame has the slack for it.
+        for (t = 0; t < taps; t++)
+            lum[t] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*) &in[offset[t] + c]));
+        for (t = 0; t < stencil->compares; t++)
+        {
+            __m256i a = lum[network[2*t]], b = lum[network[2*t+1]];
+            lum[network[2*t]]   = _mm256_min_epi32(a, b);
+            lum[network[2*t+1]] = _mm256_max_epi32(a, b);
+        }
+
+        //  run[t] taps from t on hold lum[t], which is its count where a run starts.
+        __m256i peak = one;
+        run[taps-1] = one;
+        start[0]    = 0xFF;
+        for (t = taps-2; t >= 0; t--)
+        {
+            __m256i same = _mm256_cmpeq_epi32(lum[t], lum[t+1]);
+            run[t]     = _mm256_add_epi32(one, _mm256_and_si256(same, run[t+1]));
+            peak       = _mm256_max_epi32(peak, run[t]);
+            start[t+1] = (__mmask8) ~_mm256_movemask_ps(_mm256_castsi256_ps(same));
+        }
+
+        __m512d w0 = _mm512_i32gather_pd(peak, gibbs_weight, 8), excess = _mm512_setzero_pd();
+        for (t = 0; t < taps; t++)
+        {
+            gain[t] = _mm512_sub_pd(_mm512_i32gather_pd(_mm256_sub_epi32(peak, run[t]), gibbs_weight, 8), w0);
+            excess  = _mm512_mask_add_pd(excess, start[t], excess, gain[t]);
+        }
+        __m512d target = _mm512_mul_pd(_mm512_set1_pd(THRESHOLD),
+                                       _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(256.0), w0), excess));
+
+        //  Lanes stay open until they found their crossing.
+        __m512d result = _mm512_set1_pd(255.0), next = _mm512_setzero_pd(), ramp, whole, lum1;
+        __mmask8 open = 0xFF, at, hit;
+        excess = _mm512_setzero_pd();
+        for (t = 0; t < taps && open; t++)
+        {
+            if (!(at = start[t] & open))
+                continue;
+            __m512d v = _mm512_cvtepi32_pd(lum[t]);
+
+            //  First crossing on the ramp of unused luminances next..lum-1
+            ramp   = _mm512_div_pd(_mm512_sub_pd(target, excess), w0);
+            whole  = _mm512_roundscale_pd(ramp, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            hit    = _mm512_mask_cmp_pd_mask(at, ramp, v, _CMP_LT_OQ);
+            result = _mm512_mask_mov_pd(result, hit, _mm512_mask_mov_pd(whole, _mm512_cmp_pd_mask(ramp, next, _CMP_LT_OQ), next));
+            at    &= ~hit;
+
+            //  Crossing at the occupied luminance itself
+            lum1   = _mm512_add_pd(v, _mm512_set1_pd(1.0));
+            excess = _mm512_mask_add_pd(excess, at, excess, gain[t]);
+            hit   |= _mm512_mask_cmp_pd_mask(at, _mm512_add_pd(_mm512_mul_pd(lum1, w0), excess), target, _CMP_GT_OQ);
+            result = _mm512_mask_mov_pd(result, hit & at, v);
+            next   = _mm512_mask_mov_pd(next, at, lum1);
+            open  &= ~hit;
+        }
+
+        //  Crossing on the ramp after the last occupied luminance, else the last one
+        ramp   = _mm512_div_pd(_mm512_sub_pd(target, excess), w0);
+        whole  = _mm512_roundscale_pd(ramp, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        hit    = _mm512_mask_cmp_pd_mask(open, ramp, _mm512_set1_pd(256.0), _CMP_LT_OQ);
+        result = _mm512_mask_mov_pd(result, hit, _mm512_mask_mov_pd(whole, _mm512_cmp_pd_mask(ramp, next, _CMP_LT_OQ), next));
+
+        _mm256_storeu_si256((__m256i*) level, _mm512_cvttpd_epi32(result));
+        for (x = 0; x < 8 && c+x < stage->byte_depth; x++)
+        {
+            out[c+x] = (unsigned char) level[x];
+            moved   += (out[c+x] != in[c+x]);
+        }
+    }
+    return moved;
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+int gibbs_threshold_lanes_avx2(struct GibbsStage *stage, unsigned char *in, unsigned char *out)
+{
+    //  gibbs_threshold_lanes_avx512 on 4 lanes. Masks are all-ones lanes, and lanes are
+    //  only updated by blends, so the skipped ones keep their bits.
+    struct Stencil *stencil = stage->stencil;
+    int taps = stencil->taps, *offset = stencil->offset, *network = stencil->network;
+    int c, t, x, bytes, moved = 0, level[4];
+    double *gibbs_weight = stage->gibbs_weight;
+    __m128i lum[LANE_TAPS], run[LANE_TAPS];
+    __m256d gain[LANE_TAPS], start[LANE_TAPS];
+    __m128i one = _mm_set1_epi32(1);
+    for (c = 0; c < stage->byte_depth; c += 4)
+    {
+        for (t = 0; t < taps; t++)
+        {
+            memcpy(&bytes, &in[offset[t] + c], 4);
+            lum[t] = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+        }
+        for (t = 0; t < stencil->compares; t++)
+        {
+            __m128i a = lum[network[2*t]], b = lum[network[2*t+1]];
+            lum[network[2*t]]   = _mm_min_epi32(a, b);
+            lum[network[2*t+1]] = _mm_max_epi32(a, b);
+        }
+
+        __m128i peak = one;
+        run[taps-1] = one;
+        start[0]    = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (t = taps-2; t >= 0; t--)
+        {
+            __m128i same = _mm_cmpeq_epi32(lum[t], lum[t+1]);
+            run[t]     = _mm_add_epi32(one, _mm_and_si128(same, run[t+1]));
+            peak       = _mm_max_epi32(peak, run[t]);
+            start[t+1] = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(same, _mm_set1_epi32(-1))));
+        }
+
+        __m256d w0 = _mm256_i32gather_pd(gibbs_weight, peak, 8), excess = _mm256_setzero_pd();
+        for (t = 0; t < taps; t++)
+        {
+            gain[t] = _mm256_sub_pd(_mm256_i32gather_pd(gibbs_weight, _mm_sub_epi32(peak, run[t]), 8), w0);
+            excess  = _mm256_blendv_pd(excess, _mm256_add_pd(excess, gain[t]), start[t]);
+        }
+        __m256d target = _mm256_mul_pd(_mm256_set1_pd(THRESHOLD),
+                                       _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(256.0), w0), excess));
+
+        __m256d result = _mm256_set1_pd(255.0), next = _mm256_setzero_pd(), ramp, whole, lum1, at, hit, cross;
+        __m256d open = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        excess = _mm256_setzero_pd();
+        for (t = 0; t < taps && _mm256_movemask_pd(open); t++)
+        {
+            at = _mm256_and_pd(start[t], open);
+            if (!_mm256_movemask_pd(at))
+                continue;
+            __m256d v = _mm256_cvtepi32_pd(lum[t]);
+
+            ramp   = _mm256_div_pd(_mm256_sub_pd(target, excess), w0);
+            whole  = _mm256_round_pd(ramp, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            hit    = _mm256_and_pd(at, _mm256_cmp_pd(ramp, v, _CMP_LT_OQ));
+            result = _mm256_blendv_pd(result, _mm256_blendv_pd(whole, next, _mm256_cmp_pd(ramp, next, _CMP_LT_OQ)), hit);
+            at     = _mm256_andnot_pd(hit, at);
+
+            lum1   = _mm256_add_pd(v, _mm256_set1_pd(1.0));
+            excess = _mm256_blendv_pd(excess, _mm256_add_pd(excess, gain[t]), at);
+            cross  = _mm256_and_pd(at, _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(lum1, w0), excess), target, _CMP_GT_OQ));
+            result = _mm256_blendv_pd(result, v, cross);
+            next   = _mm256_blendv_pd(next, lum1, at);
+            open   = _mm256_andnot_pd(_mm256_or_pd(hit, cross), open);
+        }
+
+        ramp   = _mm256_div_pd(_mm256_sub_pd(target, excess), w0);
+        whole  = _mm256_round_pd(ramp, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        hit    = _mm256_and_pd(open, _mm256_cmp_pd(ramp, _mm256_set1_pd(256.0), _CMP_LT_OQ));
+        result = _mm256_blendv_pd(result, _mm256_blendv_pd(whole, next, _mm256_cmp_pd(ramp, next, _CMP_LT_OQ)), hit);
+
+        _mm_storeu_si128((__m128i*) level, _mm256_cvttpd_epi32(result));
+        for (x = 0; x < 4 && c+x < stage->byte_depth; x++)
+        {
+            out[c+x] = (unsigned char) level[x];
+            moved   += (out[c+x] != in[c+x]);
+        }
+    }
+    return moved;
+}
+
+//  Kernels of the instruction set select_isa picked. The Gibbs CDF needs gathers, so
+//  SSE4.2 hosts run its scalar kernels.
+int  (*gibbs_threshold_dense)(struct Histogram *hist, double *gibbs_weight)       = gibbs_threshold_dense_scalar;
+int  (*gibbs_threshold_fixed)(struct Histogram *hist, int *fixed_weight)          = gibbs_threshold_fixed_scalar;
+void (*slide_columns)(struct Histogram *hist, int *enter, int *leave, int bins)   = slide_columns_scalar;
+void (*apply_mask)(unsigned char *img, unsigned char *mask, int size)             = apply_mask_scalar;
+int  (*gibbs_threshold_lanes)(struct GibbsStage *stage, unsigned char *in, unsigned char *out) = NULL;
+int  lane_taps = 0; // largest stencil gibbs_threshold_lanes is used for
+
+int select_isa()
+{
+    //  The widest instruction set cpuid reports, or the narrower one SEG_ISA asks for.
+    char *names[] = { "scalar", "sse4.2", "avx2", "avx512" };
+    char *forced  = getenv("SEG_ISA");
+    int isa = ISA_SCALAR, level;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        isa = ISA_SSE42;
+    if (__builtin_cpu_supports("avx2"))
+        isa = ISA_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        isa = ISA_AVX512;
+    if (forced != NULL)
+    {
+        for (level = ISA_SCALAR; level <= ISA_AVX512 && strcmp(forced, names[level]); level++)
+            ;
+        if (level > ISA_AVX512)
+            printf("SEG_ISA=%s is not one of scalar, sse4.2, avx2 or avx512.\n", forced);
+        else if (level > isa)
+            printf("SEG_ISA=%s is not supported by this CPU.\n", forced);
+        else
+            isa = level;
+    }
+
+    gibbs_threshold_dense = (isa == ISA_AVX512) ? gibbs_threshold_dense_avx512 :
+                            (isa == ISA_AVX2)   ? gibbs_threshold_dense_avx2   : gibbs_threshold_dense_scalar;
+    gibbs_threshold_fixed = (isa == ISA_AVX512) ? gibbs_threshold_fixed_avx512 :
+                            (isa == ISA_AVX2)   ? gibbs_threshold_fixed_avx2   : gibbs_threshold_fixed_scalar;
+    slide_columns         = (isa == ISA_AVX512) ? slide_columns_avx512 :
+                            (isa == ISA_AVX2)   ? slide_columns_avx2   : slide_columns_scalar;
+    apply_mask            = (isa == ISA_AVX512) ? apply_mask_avx512 :
+                            (isa == ISA_AVX2)   ? apply_mask_avx2   :
+                            (isa == ISA_SSE42)  ? apply_mask_sse42  : apply_mask_scalar;
+    gibbs_threshold_lanes = (isa == ISA_AVX512) ? gibbs_threshold_lanes_avx512 :
+                            (isa == ISA_AVX2)   ? gibbs_threshold_lanes_avx2   : NULL;
+    lane_taps             = (isa == ISA_AVX512) ? LANE_TAPS : (isa == ISA_AVX2) ? LANE_TAPS/2 : 0;
+    printf("Using the %s kernels.\n", names[isa]);
+    return isa;
+}
+
+void clear_histograms(struct Histogram *hist, int *counts, int byte_depth, int shift)
+{
+    //  Empty histograms of every channel, in bins of 1 << shift luminances. Their counts
+    //  are stored back to back in counts, 256 >> shift per channel, so that the fewer
+    //  the bins, the fewer cache lines a pixel's histograms take.
+    int k, bins = 256 >> shift;
+    memset(hist, 0, byte_depth * sizeof(struct Histogram));
+    memset(counts, 0, (size_t) byte_depth * bins * sizeof(int));
+    for (k = 0; k < byte_depth; k++)
+    {
+        hist[k].count = &counts[k*bins];
+        hist[k].shift = shift;
+        hist[k].stale = (1u << (16 >> shift)) - 1;
+    }
+}
+
+void build_histogram(struct Histogram *hist, int *counts, unsigned char *pixel, struct Stencil *stencil, int byte_depth,
+                     int channel_stride, int shift)
+{
+    //  Count every neighbor of the pixel from scratch.
+    int n;
+    clear_histograms(hist, counts, byte_depth, shift);
+    for (n = 0; n < stencil->taps; n++)
+        add_neighbor(hist, &pixel[stencil->offset[n]], byte_depth, channel_stride, 1);
+}
+
+static inline __attribute__((always_inline))
+int gibbs_threshold_double(struct GibbsStage *stage, struct Histogram *hist)
+{
+    //  Threshold one channel in double by the solver its histogram calls for.
+    if (hist->distinct <= SPARSE_BINS)
+        return gibbs_threshold_sparse(hist, stage->gibbs_weight);
+    if (stage->coarse)
+        return gibbs_threshold_coarse(hist, stage->gibbs_weight);
+    return gibbs_threshold_dense(hist, stage->gibbs_weight);
+}
+
+int threshold_pixel(struct GibbsStage *stage, struct Histogram *hist, unsigned char *in, unsigned char *out,
+                    int byte_depth, int cs, long long *differ)
+{
+    //  Threshold every channel of one pixel from its histograms into out.
+    //  Returns how many channels end up different from in.
+    int k, moved = 0;
+    for (k = 0; k < byte_depth; k++)
+    {
+        int lum;
+        if (hist[k].distinct <= SPARSE_BINS || stage->coarse || stage->fixed_weight == NULL)
+            lum = gibbs_threshold_double(stage, &hist[k]);
+        else
+        {
+            lum = gibbs_threshold_fixed(&hist[k], stage->fixed_weight);
+            if (stage->fixed_report)
+                *differ += (lum != gibbs_threshold_double(stage, &hist[k]));
+        }
+        if (lum >= 0)
+            out[k*cs] = (unsigned char) lum;
+        moved += (out[k*cs] != in[k*cs]);
+    }
+    return moved;
+}
+
+static inline __attribute__((always_inline))
+long long gibbs_tile_kernel(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end,
+                            const int depth, const int radius)
+{
+    //  Returns how many pixel channels of the tile end up different from img_copy.
+    //  A nonzero depth or radius is a compile-time byte_depth or stencil half-size of
+    //  the instantiation, which lets the channel and stencil loops unroll; 0 reads it
+    //  from the stage.
+    struct Stencil *stencil  = stage->stencil;
+    unsigned char  *img_copy = stage->img_copy;
+    unsigned char  *dirty    = stage->dirty;
+    int width = stage->width, byte_width = stage->byte_width;
+    int byte_depth = depth ? depth : stage->byte_depth;
+    int rows = radius ? radius : stencil->rows, cols = radius ? radius : stencil->cols;
+    int ps = stage->pixel_stride, cs = stage->channel_stride;
+    int *mStart = stencil->mStart, *mEnd = stencil->mEnd;
+    int *lStart = stencil->lStart, *lEnd = stencil->lEnd;
+    int i, j, k, l, m, n;
+    long long changed = 0, differ = 0;
+
+    //  Neighbor luminance counts of every channel for pixel (hist_row,hist_col).
+    //  Rows are walked in serpentine order, so moving to the next pixel is always a
+    //  one-step slide of the stencil: only its leaving edge is removed and its entering
+    //  edge added, instead of recounting every tap.
+    //  Clean pixels are copied. The counts are only slid across a run of them when the
+    //  next dirty pixel is close enough for that to be cheaper than recounting there.
+    struct Histogram hist[MAX_CHANNELS];
+    int counts[MAX_CHANNELS*256] __attribute__((aligned(64)));
+    int valid = 0, hist_row = 0, hist_col = 0;
+    int gap = stencil->taps / (2*(2*rows+1));
+    int row_length = col_end - col_begin;
+    if (row_length <= 0 || row_begin >= row_end)
+        return 0;
+
+    for (i = row_begin; i < row_end; i++)
+    {
+        int dir = ((i-row_begin) & 1) ? -1 : 1;
+        int *leaving  = (dir > 0) ? mStart : mEnd;
+        int *entering = (dir > 0) ? mEnd : mStart;
+        int ahead = -1; // a dirty pixel further along the row, if one was looked for
+        j = (dir > 0) ? col_begin : col_end-1;
+        for (n = 0; n < row_length; n++, j += dir)
+        {
+            unsigned char *in  = &img_copy[i*byte_width+j*ps];
+            unsigned char *out = &stage->img_mask[i*byte_width+j*ps];
+            int recompute = (dirty == NULL) || dirty[i*width+j];
+            if (!recompute && valid && ahead <= n)
+            {
+                for (ahead = n+1; ahead < row_length && ahead <= n+gap; ahead++)
+                    if (dirty[i*width+j+(ahead-n)*dir])
+                        break;
+                if (ahead >= row_length || ahead > n+gap)
+                    valid = 0;
+            }
+
+            //  Slide the stencil horizontally from the previous pixel (i,j-dir).
+            if (recompute || valid)
+            {
+                if (valid && hist_row == i && hist_col == j-dir)
+                    for (l = -rows; l <= rows; l++)
+                    {
+                        unsigned char *row = &img_copy[(i+l)*byte_width];
+                        add_neighbor(hist, &row[(j-dir+leaving[l])*ps], byte_depth, cs, -1);
+                        add_neighbor(hist, &row[(j   +entering[l])*ps], byte_depth, cs,  1);
+                    }
+                else if (!valid || hist_row != i || hist_col != j)
+                    build_histogram(hist, counts, in, stencil, byte_depth, cs, stage->bin_shift);
+                valid = 1, hist_row = i, hist_col = j;
+            }
+
+            if (!recompute)
+            {
+                for (k = 0; k < byte_depth; k++)
+                    out[k*cs] = in[k*cs];
+                stage->moved[i*width+j] = 0;
+                continue;
+            }
+
+            int moved = threshold_pixel(stage, hist, in, out, byte_depth, cs, &differ);
+            stage->moved[i*width+j] = (moved > 0);
+            changed += moved;
+        }
+
+        //  Slide the stencil one row down, staying on the column the row ended at.
+        j -= dir;
+        if (i+1 < row_end && valid && hist_row == i && hist_col == j)
+        {
+            for (m = -cols; m <= cols; m++)
+            {
+                add_neighbor(hist, &img_copy[(i  +lStart[m])*byte_width + (j+m)*ps], byte_depth, cs, -1);
+                add_neighbor(hist, &img_copy[(i+1+lEnd[m]  )*byte_width + (j+m)*ps], byte_depth, cs,  1);
+            }
+            hist_row = i+1;
+        }
+    }
+    if (differ)
+        __atomic_add_fetch(&stage->fixed_differ, differ, __ATOMIC_RELAXED);
+    return changed;
+}
+
+//  Instantiations of the tile kernel for the usual byte depths and small stencils,
+//  gibbs_tile_<depth>_<radius>, and the generic gibbs_tile_0_0.
+#define GIBBS_TILE(depth, radius) \
+long long gibbs_tile_##depth##_##radius(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end) \
+{ \
+    return gibbs_tile_kernel(stage, row_begin, row_end, col_begin, col_end, depth, radius); \
+}
+#define GIBBS_TILES(depth) \
+GIBBS_TILE(depth, 0) GIBBS_TILE(depth, 1) GIBBS_TILE(depth, 2) GIBBS_TILE(depth, 3) GIBBS_TILE(depth, 4) \
+GIBBS_TILE(depth, 5) GIBBS_TILE(depth, 6) GIBBS_TILE(depth, 7) GIBBS_TILE(depth, 8)
+GIBBS_TILE(0, 0)
+GIBBS_TILES(1)
+GIBBS_TILES(3)
+GIBBS_TILES(4)
+
+#define GIBBS_RADII 8
+#define GIBBS_TILE_ROW(depth) \
+{ gibbs_tile_##depth##_0, gibbs_tile_##depth##_1, gibbs_tile_##depth##_2, gibbs_tile_##depth##_3, gibbs_tile_##depth##_4, \
+  gibbs_tile_##depth##_5, gibbs_tile_##depth##_6, gibbs_tile_##depth##_7, gibbs_tile_##depth##_8 }
+GibbsTile gibbs_tiles[5][GIBBS_RADII+1] = { { gibbs_tile_0_0 }, GIBBS_TILE_ROW(1), { gibbs_tile_0_0 },
+                                            GIBBS_TILE_ROW(3), GIBBS_TILE_ROW(4) };
+
+long long gibbs_tile_columns(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end)
+{
+    //  Tile kernel for rectangular stencils, whose cost does not grow with the radius.
+    //  Every column of the tile and its halo keeps a histogram of its 2*rows+1 pixels
+    //  around the current row, so moving down a row only moves two pixels per column.
+    //  Moving right a pixel then adds the entering column's histogram to the window and
+    //  subtracts the leaving one's, a fixed number of bins whatever the radius.
+    struct Stencil *stencil  = stage->stencil;
+    unsigned char  *img_copy = stage->img_copy;
+    int width = stage->width, byte_width = stage->byte_width, byte_depth = stage->byte_depth;
+    int ps = stage->pixel_stride, cs = stage->channel_stride, shift = stage->bin_shift;
+    int rows = stencil->rows, cols = stencil->cols, bins = 256 >> shift;
+    int span = col_end - col_begin + 2*cols;
+    int i, j, k, l, c;
+    long long changed = 0, differ = 0;
+    if (col_end <= col_begin || row_begin >= row_end)
+        return 0;
+
+    //  column[(c*byte_depth + k)*bins + bin] counts channel k of column col_begin-cols+c.
+    //  One more column of zeros starts every row's window.
+    int *column = (int*) calloc((size_t) (span+1) * byte_depth * bins, sizeof(int));
+    int *none   = &column[span * byte_depth * bins];
+    struct Histogram hist[MAX_CHANNELS];
+    int counts[MAX_CHANNELS*256] __attribute__((aligned(64)));
+    for (c = 0; c < span; c++)
+        for (l = -rows; l <= rows; l++)
+            for (k = 0; k < byte_depth; k++)
+                column[(c*byte_depth + k)*bins +
+                       (img_copy[(row_begin+l)*byte_width + (col_begin-cols+c)*ps + k*cs] >> shift)]++;
+
+    for (i = row_begin; i < row_end; i++)
+    {
+        if (i > row_begin)
+            for (c = 0; c < span; c++)
+            {
+                unsigned char *pixel = &img_copy[i*byte_width + (col_begin-cols+c)*ps];
+                for (k = 0; k < byte_depth; k++)
+                {
+                    column[(c*byte_depth + k)*bins + (pixel[(-rows-1)*byte_width + k*cs] >> shift)]--;
+                    column[(c*byte_depth + k)*bins + (pixel[  rows   *byte_width + k*cs] >> shift)]++;
+                }
+            }
+
+        //  Window of the first pixel of the row, from the first 2*cols+1 columns.
+        clear_histograms(hist, counts, byte_depth, shift);
+        for (k = 0; k < byte_depth; k++)
+            for (c = 0; c <= 2*cols; c++)
+                slide_columns(&hist[k], &column[(c*byte_depth + k)*bins], none, bins);
+
+        for (j = col_begin; j < col_end; j++)
+        {
+            unsigned char *in  = &img_copy[i*byte_width+j*ps];
+            unsigned char *out = &stage->img_mask[i*byte_width+j*ps];
+            c = j - col_begin;
+            if (c > 0)
+                for (k = 0; k < byte_depth; k++)
+                {
+                    slide_columns(&hist[k], &column[((c+2*cols)*byte_depth + k)*bins],
+                                            &column[((c-1)*byte_depth + k)*bins], bins);
+                    hist[k].stale = (1u << (16 >> shift)) - 1;
+                }
+
+            //  Clean pixels are copied, the window slides past them anyway.
+            if (stage->dirty != NULL && !stage->dirty[i*width+j])
+            {
+                for (k = 0; k < byte_depth; k++)
+                    out[k*cs] = in[k*cs];
+                stage->moved[i*width+j] = 0;
+                continue;
+            }
+            int moved = threshold_pixel(stage, hist, in, out, byte_depth, cs, &differ);
+            stage->moved[i*width+j] = (moved > 0);
+            changed += moved;
+        }
+    }
+    free(column);
+    if (differ)
+        __atomic_add_fetch(&stage->fixed_differ, differ, __ATOMIC_RELAXED);
+    return changed;
+}
+
+long long gibbs_tile_lanes(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end)
+{
+    //  Tile kernel of a batch of thumbnails. Their stencils are too small for sliding a
+    //  histogram to pay off, so every pixel sorts its taps instead, and the stacked
+    //  channels of the batch are thresholded side by side, one per SIMD lane.
+    int width = stage->width, byte_width = stage->byte_width, ps = stage->pixel_stride;
+    int i, j, k;
+    long long changed = 0;
+    for (i = row_begin; i < row_end; i++)
+        for (j = col_begin; j < col_end; j++)
+        {
+            unsigned char *in  = &stage->img_copy[i*byte_width+j*ps];
+            unsigned char *out = &stage->img_mask[i*byte_width+j*ps];
+            if (stage->dirty != NULL && !stage->dirty[i*width+j])
+            {
+                for (k = 0; k < stage->byte_depth; k++)
+                    out[k] = in[k];
+                stage->moved[i*width+j] = 0;
+                continue;
+            }
+            int moved = gibbs_threshold_lanes(stage, in, out);
+            stage->moved[i*width+j] = (moved > 0);
+            changed += moved;
+        }
+    return changed;
+}
+
+GibbsTile select_tile(int byte_depth, struct Stencil *stencil)
+{
+    //  The column engine for wide enough rectangular stencils, otherwise the kernel
+    //  specialized for this byte depth and stencil, or the generic one.
+    //  Only stencils as high as they are wide have a radius to specialize on.
+    int radius = (stencil->rows == stencil->cols && stencil->rows <= GIBBS_RADII) ? stencil->rows : 0;
+    if (stencil->taps == (2*stencil->rows+1) * (2*stencil->cols+1) && stencil->cols >= COLUMN_RADIUS)
+        return gibbs_tile_columns;
+    if (byte_depth != 1 && byte_depth != 3 && byte_depth != 4)
+        return gibbs_tile_0_0;
+    return gibbs_tiles[byte_depth][radius];
+}
+
+int flat_block(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end,
+               unsigned char *lum)
+{
+    //  Whether the stencil bounding box of every pixel of the block holds one luminance
+    //  per channel, then returned in lum. A row is one luminance per channel exactly when
+    //  it equals itself shifted by one pixel, and every row must equal the first.
+    int rows = stage->stencil->rows, cols = stage->stencil->cols;
+    int ps = stage->pixel_stride, cs = stage->channel_stride, byte_width = stage->byte_width;
+    int planes = (cs == 1) ? 1 : stage->byte_depth;
+    int span = (col_end - col_begin + 2*cols) * ps, i, k;
+    unsigned char *corner = &stage->img_copy[(row_begin-rows)*byte_width + (col_begin-cols)*ps];
+    for (k = 0; k < planes; k++)
+    {
+        unsigned char *first = corner + k*cs;
+        if (memcmp(first + ps, first, span - ps))
+            return 0;
+        for (i = 1; i < row_end - row_begin + 2*rows; i++)
+            if (memcmp(first + i*byte_width, first, span))
+                return 0;
+    }
+    for (k = 0; k < stage->byte_depth; k++)
+        lum[k] = corner[k*cs];
+    return 1;
+}
+
+long long flat_fill(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end,
+                    unsigned char *lum)
+{
+    //  Threshold a flat block from the table; its input is lum everywhere.
+    int ps = stage->pixel_stride, cs = stage->channel_stride, width = stage->width;
+    int i, j, k, moved = 0;
+    long long changed = 0;
+    for (k = 0; k < stage->byte_depth; k++)
+        moved += (stage->flat[lum[k]] != lum[k]);
+    for (i = row_begin; i < row_end; i++)
+        for (j = col_begin; j < col_end; j++)
+        {
+            unsigned char *out = &stage->img_mask[i*stage->byte_width + j*ps];
+            int clean = (stage->dirty != NULL && !stage->dirty[i*width+j]);
+            for (k = 0; k < stage->byte_depth; k++)
+                out[k*cs] = clean ? lum[k] : stage->flat[lum[k]];
+            stage->moved[i*width+j] = !clean && moved > 0;
+            changed += clean ? 0 : moved;
+        }
+    return changed;
+}
+
+long long gibbs_tile_flat(struct GibbsStage *stage, int row_begin, int row_end, int col_begin, int col_end)
+{
+    //  The tile kernel, except on flat blocks. A tile with a flat block is taken one strip
+    //  of FLAT_BLOCK rows at a time: its flat blocks are filled from the table and the runs
+    //  of other blocks between them left to the kernel. Other tiles go to the kernel whole.
+    unsigned char lum[MAX_CHANNELS];
+    int i, j, run, flat = 0;
+    long long changed = 0;
+    if (stage->flat == NULL)
+        return stage->tile(stage, row_begin, row_end, col_begin, col_end);
+    for (i = row_begin; i < row_end && !flat; i += FLAT_BLOCK)
+        for (j = col_begin; j < col_end && !flat; j += FLAT_BLOCK)
+            flat = flat_block(stage, i, (i + FLAT_BLOCK < row_end) ? i + FLAT_BLOCK : row_end,
+                                     j, (j + FLAT_BLOCK < col_end) ? j + FLAT_BLOCK : col_end, lum);
+    if (!flat)
+        return stage->tile(stage, row_begin, row_end, col_begin, col_end);
+
+    for (i = row_begin; i < row_end; i += FLAT_BLOCK)
+    {
+        int strip_end = (i + FLAT_BLOCK < row_end) ? i + FLAT_BLOCK : row_end;
+        for (run = j = col_begin; j < col_end; j += FLAT_BLOCK)
+        {
+            int block_end = (j + FLAT_BLOCK < col_end) ? j + FLAT_BLOCK : col_end;
+            if (!flat_block(stage, i, strip_end, j, block_end, lum))
+                continue;
+            changed += stage->tile(stage, i, strip_end, run, j);
+            changed += flat_fill(stage, i, strip_end, j, block_end, lum);
+            run = block_end;
+        }
+        changed += stage->tile(stage, i, strip_end, run, col_end);
+    }
+    return changed;
+}
+
+long long gibbs_band(struct GibbsStage *stage, int row_begin, int row_end)
+{
+    //  Sweep the band tile by tile, each tile left to right within a row of tiles.
+    int tile_row, tile_col;
+    int col_first = stage->first_col, col_last = stage->last_col;
+    long long changed = 0;
+    for (tile_row = row_begin; tile_row < row_end; tile_row += stage->tile_rows)
+        for (tile_col = col_first; tile_col < col_last; tile_col += stage->tile_cols)
+            changed += gibbs_tile_flat(stage, tile_row, (tile_row + stage->tile_rows < row_end) ?
+                                                           tile_row + stage->tile_rows : row_end,
+                                              tile_col, (tile_col + stage->tile_cols < col_last) ?
+                                                           tile_col + stage->tile_cols : col_last);
+    return changed;
+}
+
+int settle_images(struct GibbsStage *stage, int image_depth, double convergence, int *settled)
+{
+    //  Convergence of a stack of images of image_depth channels each, judged per image as
+    //  it would be alone. An image whose channels the iteration changed less than the
+    //  convergence fraction of is settled; the channels of one settled before are restored
+    //  from img_copy, so it keeps the result it converged at. That includes the border an
+    //  iteration does not compute, which otherwise alternates with the buffers.
+    //  Returns how many are not.
+    long long changed[MAX_CHANNELS] = { 0 };
+    int images = stage->byte_depth / image_depth, cs = stage->channel_stride;
+    int i, j, k, n, unsettled = 0;
+    for (i = 0; i < stage->height; i++)
+        for (j = 0; j < stage->width; j++)
+        {
+            unsigned char *in  = stage->img_copy + (size_t) i*stage->byte_width + j*stage->pixel_stride;
+            unsigned char *out = stage->img_mask + (size_t) i*stage->byte_width + j*stage->pixel_stride;
+            int computed = (i >= stage->first_row && i < stage->last_row &&
+                            j >= stage->first_col && j < stage->last_col);
+            for (k = 0; k < stage->byte_depth; k++)
+                if (settled[k / image_depth])
+                    out[k*cs] = in[k*cs];
+                else if (computed)
+                    changed[k / image_depth] += (out[k*cs] != in[k*cs]);
+        }
+    long long computed = (long long) (stage->last_row - stage->first_row) *
+                                     (stage->last_col - stage->first_col) * image_depth;
+    for (n = 0; n < images; n++)
+    {
+        settled[n] |= (changed[n] < convergence * computed);
+        unsettled  += !settled[n];
+    }
+    return unsettled;
+}
+
+long long dilate_changes(struct GibbsStage *stage, unsigned char *scratch)
+{
+    //  A pixel has to be recomputed when a pixel of its stencil's bounding box changed.
+    //  The box is dilated one axis at a time with running counts; returns how many pixels
+    //  the next iteration recomputes. Changes next to the image edge reach the ghost zone
+    //  only through pixels that are at least as close, so the box covers them too.
+    int i, j, width = stage->width, height = stage->height;
+    int rows = stage->stencil->rows, cols = stage->stencil->cols;
+    long long dirty = 0;
+    for (i = 0; i < height; i++)
+    {
+        unsigned char *moved = &stage->moved[i*width];
+        int count = 0;
+        for (j = 0; j < cols && j < width; j++)
+            count += moved[j];
+        for (j = 0; j < width; j++)
+        {
+            if (j+cols < width)
+                count += moved[j+cols];
+            if (j-cols-1 >= 0)
+                count -= moved[j-cols-1];
+            scratch[i*width+j] = (count > 0);
+        }
+    }
+    for (j = 0; j < width; j++)
+    {
+        int count = 0;
+        for (i = 0; i < rows && i < height; i++)
+            count += scratch[i*width+j];
+        for (i = 0; i < height; i++)
+        {
+            if (i+rows < height)
+                count += scratch[(i+rows)*width+j];
+            if (i-rows-1 >= 0)
+                count -= scratch[(i-rows-1)*width+j];
+            stage->dirty[i*width+j] = (count > 0);
+            dirty += (count > 0);
+        }
+    }
+    return dirty;
+}
+
+void size_tiles(struct GibbsStage *stage)
+{
+    //  A tile is swept in serpentine rows, so its hot set is the 2*rows+1 input rows
+    //  under the stencil: as wide a tile as keeps those rows in TILE_CACHE. Its height
+    //  then keeps the whole tile input, halos of rows and cols included, in the budget.
+    //  Both are at least a stencil wide, so the histogram start-up of every tile
+    //  stays small next to the slides it saves.
+    int rows = stage->stencil->rows, cols = stage->stencil->cols;
+    int tile_cols = TILE_CACHE / ((2*rows+1) * stage->byte_depth) - 2*cols;
+    if (tile_cols < 2*cols+1)
+        tile_cols = 2*cols+1;
+    int tile_rows = TILE_CACHE / ((tile_cols + 2*cols) * stage->byte_depth) - 2*rows;
+    if (tile_rows < 2*rows+1)
+        tile_rows = 2*rows+1;
+    stage->tile_rows = tile_rows;
+    stage->tile_cols = tile_cols;
+}
+
+long long wavefront_part(struct Wavefront *wave, int t, int count)
+{
+    //  Worker t's columns of the chunk every iteration computes at this step.
+    int h;
+    for (h = 0; h < wave->iterations; h++)
+    {
+        struct GibbsStage *stage = &wave->level[h & 1];
+        int chunk = wave->step - h*wave->lag, cols = stage->last_col - stage->first_col;
+        if (chunk < 0 || chunk >= wave->chunks)
+            continue;
+        int row_begin = stage->first_row + chunk*wave->chunk_rows;
+        int row_end   = (row_begin + wave->chunk_rows < stage->last_row) ? row_begin + wave->chunk_rows : stage->last_row;
+        int col_begin = stage->first_col + (long long) cols*t/count, col;
+        int col_end   = stage->first_col + (long long) cols*(t+1)/count;
+        long long changed = 0;
+        for (col = col_begin; col < col_end; col += stage->tile_cols)
+            changed += gibbs_tile_flat(stage, row_begin, row_end, col,
+                                       (col + stage->tile_cols < col_end) ? col + stage->tile_cols : col_end);
+        __atomic_add_fetch(&wave->changed[h], changed, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int numa_nodes(void)
+{
+    //  NUMA nodes sysfs lists, numbered from 0.
+    char path[64];
+    int nodes = 0;
+    for (;; nodes++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nodes);
+        if (access(path, F_OK) != 0)
+            return nodes;
+    }
+}
+
+int pin_to_node(int node)
+{
+    //  Restrict the calling thread to the CPUs of NUMA node node, from its sysfs cpulist
+    //  ("0-7,16-23"). Returns whether it could.
+    char path[64], list[4096], *next = list;
+    cpu_set_t cpus;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    if (fgets(list, sizeof(list), file) == NULL)
+        list[0] = '\0';
+    fclose(file);
+    CPU_ZERO(&cpus);
+    while (*next >= '0' && *next <= '9')
+    {
+        int cpu = (int) strtol(next, &next, 10), last = cpu;
+        if (*next == '-')
+            last = (int) strtol(next+1, &next, 10);
+        for (; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &cpus);
+        if (*next == ',')
+            next++;
+    }
+    return CPU_COUNT(&cpus) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+long long touch_band(struct WorkerPool *pool, int t)
+{
+    //  Write the rows of worker t's band in both frames and in the moved map first, so the
+    //  kernel places their pages on its node. The first and last workers also take the
+    //  rows above and below the computed ones.
+    struct GibbsStage *stage = pool->stage;
+    struct Frame      *frame = pool->frame;
+    int byte_width = frame->byte_width, lead_bytes = frame->lead - frame->pad_rows*byte_width;
+    int planes     = (frame->channel_stride == 1) ? 1 : stage->byte_depth, k;
+    int row_begin  = t ? pool->band[t] : -frame->pad_rows;
+    int row_end    = (t < pool->count-1) ? pool->band[t+1] : stage->height + frame->pad_rows;
+    for (k = 0; k < planes; k++)
+    {
+        ptrdiff_t row = (ptrdiff_t) k*frame->channel_stride - lead_bytes + (ptrdiff_t) row_begin*byte_width;
+        memset(stage->img_copy + row, 0, (size_t) (row_end - row_begin) * byte_width);
+        memset(stage->img_mask + row, 0, (size_t) (row_end - row_begin) * byte_width);
+    }
+    row_begin = (row_begin > 0) ? row_begin : 0;
+    row_end   = (row_end < stage->height) ? row_end : stage->height;
+    if (row_end > row_begin)
+        memset(stage->moved + (size_t) row_begin*stage->width, 0, (size_t) (row_end - row_begin) * stage->width);
+    return 0;
+}
+
+long long pool_part(struct WorkerPool *pool, int t)
+{
+    //  What worker t computes of an iteration, or of a wavefront step, or touches first.
+    if (pool->frame != NULL)
+        return touch_band(pool, t);
+    if (pool->wave != NULL)
+        return wavefront_part(pool->wave, t, pool->count);
+    return gibbs_band(pool->stage, pool->band[t], pool->band[t+1]);
+}
+
+void *gibbs_worker(void *arg)
+{
+    //  Wait for the main thread to publish an iteration, compute this worker's band
+    //  and report back. The threads live until the pool is told to quit.
+    struct Worker     *worker = (struct Worker*) arg;
+    struct WorkerPool *pool   = worker->pool;
+    if (pool->nodes > 0)
+        pin_to_node((int) ((long long) worker->id * pool->nodes / pool->count));
+    for (;;)
+    {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit)
+            break;
+        pool->changed[worker->id] = pool_part(pool, worker->id);
+        pthread_barrier_wait(&pool->done);
+    }
+    free(worker);
+    return NULL;
+}
+
+long long run_pool(struct WorkerPool *pool);
+
+void start_pool(struct WorkerPool *pool, struct GibbsStage *stage, int count, struct Frame *numa)
+{
+    //  The rows the stage computes are split evenly.
+    //  The main thread computes band 0 itself, so count-1 threads are started.
+    //  Given the frame layout in numa, the workers are pinned and place their bands.
+    int t, first = stage->first_row, rows = stage->last_row - first;
+    pool->stage   = stage;
+    pool->wave    = NULL;
+    pool->count   = count;
+    pool->nodes   = (numa != NULL) ? numa_nodes() : 0;
+    pool->frame   = NULL;
+    pool->quit    = 0;
+    pool->threads = (pthread_t*) malloc(count * sizeof(pthread_t));
+    pool->band    = (int*) malloc((count+1) * sizeof(int));
+    pool->changed = (long long*) calloc(count, sizeof(long long));
+    for (t = 0; t <= count; t++)
+        pool->band[t] = first + (rows > 0 ? (long long) rows*t/count : 0);
+    pthread_barrier_init(&pool->start, NULL, count);
+    pthread_barrier_init(&pool->done,  NULL, count);
+    for (t = 1; t < count; t++)
+    {
+        struct Worker *worker = (struct Worker*) malloc(sizeof(struct Worker));
+        worker->pool = pool;
+        worker->id   = t;
+        pthread_create(&pool->threads[t], NULL, gibbs_worker, worker);
+    }
+    if (pool->nodes > 0)
+    {
+        pthread_getaffinity_np(pthread_self(), sizeof(pool->affinity), &pool->affinity);
+        pin_to_node(0);
+        pool->frame = numa;
+        run_pool(pool);
+        pool->frame = NULL;
+    }
+}
+
+long long run_pool(struct WorkerPool *pool)
+{
+    //  One Gibbs iteration over the current img_copy/img_mask of the stage.
+    //  Returns how many pixel channels it changed.
+    int t;
+    long long changed;
+    pthread_barrier_wait(&pool->start);
+    pool->changed[0] = pool_part(pool, 0);
+    pthread_barrier_wait(&pool->done);
+    for (changed = 0, t = 0; t < pool->count; t++)
+        changed += pool->changed[t];
+    return changed;
+}
+
+void stop_pool(struct WorkerPool *pool)
+{
+    int t;
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for (t = 1; t < pool->count; t++)
+        pthread_join(pool->threads[t], NULL);
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    if (pool->nodes > 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(pool->affinity), &pool->affinity);
+    free(pool->threads);
+    free(pool->band);
+    free(pool->changed);
+}
+
+unsigned char *run_wavefront(struct WorkerPool *pool, struct Frame *frame, unsigned char *image, unsigned char *spare,
+                             int iterations)
+{
+    //  Every iteration in one sweep over the rows. image holds the input and spare is the
+    //  other frame; returns whichever of the two ends up holding the result.
+    //  An iteration writes into the frame the one before it still reads, so it stays lag
+    //  chunks behind: far enough that all the rows it reads are final and that the
+    //  previous iteration is done with every row it overwrites.
+    struct GibbsStage *stage = pool->stage;
+    struct Wavefront   wave;
+    int h, chunk, rows = stage->last_row - stage->first_row, radius = stage->stencil->rows;
+    int row_bytes  = frame->size / (stage->height + 2*frame->pad_rows);
+    int chunk_rows = WAVEFRONT_CACHE / (4 * iterations * row_bytes) - radius;
+    if (chunk_rows < 1)
+        chunk_rows = 1;
+    wave.level[0] = wave.level[1] = *stage;
+    wave.level[0].dirty    = wave.level[1].dirty    = NULL;
+    wave.level[0].img_copy = wave.level[1].img_mask = image;
+    wave.level[0].img_mask = wave.level[1].img_copy = spare;
+    wave.chunk_rows = chunk_rows;
+    wave.chunks     = (rows + chunk_rows - 1) / chunk_rows;
+    wave.lag        = 1 + (radius + chunk_rows - 1) / chunk_rows;
+    wave.iterations = iterations;
+    wave.changed    = (long long*) calloc(iterations, sizeof(long long));
+
+    pool->wave = &wave;
+    for (wave.step = 0; wave.step < wave.chunks + (iterations-1)*wave.lag; wave.step++)
+    {
+        run_pool(pool);
+
+        //  Ghost zone of the rows just computed, before the next iteration reads them.
+        for (h = 0; h < iterations && BORDER != BORDER_NONE; h++)
+            if ((chunk = wave.step - h*wave.lag) >= 0 && chunk < wave.chunks)
+            {
+                int row_begin = stage->first_row + chunk*chunk_rows;
+                int row_end   = (row_begin + chunk_rows < stage->last_row) ? row_begin + chunk_rows : stage->last_row;
+                fill_border_rows(wave.level[h & 1].img_mask, frame, stage->width, stage->height,
+                                 stage->byte_depth, BORDER, row_begin, row_end);
+            }
+    }
+    pool->wave = NULL;
+
+    for (h = 0; h < iterations; h++)
+        printf("Iteration %d done. %lld pixel channels changed.\n", h+1, wave.changed[h]);
+    free(wave.changed);
+    return (iterations & 1) ? spare : image;
+}
+
+unsigned char *gibbs_mrf(unsigned char *img, int byte_width, int width, int height, int byte_depth,
+                         int image_depth, int partition, int iterations, int threads, struct Frame *frame)
+{
+    //  Thresholds img in place by the Gibbs MRF, whose radius is its size over partition.
+    //  img stacks images of image_depth of its byte_depth channels each, which converge
+    //  on their own; image_depth is byte_depth for a single image.
+    //  The result is also returned in a Gibbs frame laid out as *frame, which the
+    //  caller frees from frame->lead bytes before the returned pointer.
+    int byte_offset = (width < height) ? width/partition : height/partition;
+    int h, n;
+    int stencil_rows = (STENCIL == STENCIL_ELLIPSE) ? height/partition : byte_offset;
+    int stencil_cols = (STENCIL == STENCIL_ELLIPSE) ? width /partition : byte_offset;
+
+    //  Gibbs buffers, interleaved or planar, with cache-line aligned rows. Without a border
+    //  policy only the pixels whose whole neighborhood lies inside the image are computed.
+    //  Otherwise every pixel is, reading its missing neighbors from a ghost zone of
+    //  stencil_rows and stencil_cols.
+    if (BORDER != BORDER_NONE)
+        frame_layout(frame, width, height, byte_depth, stencil_rows, stencil_cols, PLANAR);
+    else
+        frame_layout(frame, width, height, byte_depth, 0, 0, PLANAR);
+    unsigned char *frame_copy = (unsigned char*) alloc_buffer(frame->size) + frame->lead;
+    unsigned char *frame_mask = (unsigned char*) alloc_buffer(frame->size) + frame->lead;
+
+    //  Neighborhood taps of every pixel, as spans and as byte offsets from the pixel.
+    struct Stencil stencil;
+    build_stencil(&stencil, STENCIL, stencil_rows, stencil_cols, frame->byte_width, frame->pixel_stride);
+    int taps  = stencil.taps;
+
+    //  The Gibbs energy of a luminance only depends on how many neighbors share it:
+    //  E = (order << 2) - 5*count. Only PDF weights exp(-E/TEMPERATURE) relative to each
+    //  other matter to the threshold, so they are taken relative to the neighborhood's most
+    //  frequent luminance, exp(-5*(peak - count)/TEMPERATURE). Unlike the absolute weights
+    //  those never overflow, and the peak's own is 1 at any radius. They are tabulated
+    //  once per image for every shortfall 0..taps.
+    double *gibbs_weight = (double*) malloc((taps+1) * sizeof(double));
+    for (n = 0; n <= taps; n++)
+        gibbs_weight[n] = exp(-5.0*n/TEMPERATURE);
+
+    //  Fixed-point weight of a luminance n counts short of the most frequent one,
+    //  relative to 2^23 for the most frequent one itself.
+    int *fixed_weight = NULL;
+    if (env_or("SEG_FIXED_POINT", FIXED_POINT))
+    {
+        fixed_weight = (int*) malloc((taps+1) * sizeof(int));
+        for (n = 0; n <= taps; n++)
+            fixed_weight[n] = (int) (8388607.0 * exp(-5.0*n/TEMPERATURE) + 0.5);
+    }
+
+    //  Bin width of the histograms.
+    int bins = (int) env_or("SEG_BINS", BINS), bin_shift = 0;
+    while (bin_shift < 3 && (256 >> bin_shift) > bins)
+        bin_shift++;
+    if ((256 >> bin_shift) != bins)
+        printf("BINS must be 32, 64, 128 or 256, not %d. Using %d.\n", bins, 256 >> bin_shift);
+
+    //  Output of a pixel with luminance v at every tap, from a histogram of that one bin.
+    unsigned char flat[256];
+    for (n = 0; n < 256; n++)
+    {
+        struct Histogram single;
+        int counts[256];
+        clear_histograms(&single, counts, 1, bin_shift);
+        single.count[n >> bin_shift] = taps;
+        single.distinct = 1;
+        single.occupied[(n >> bin_shift) >> 6] = 1ULL << ((n >> bin_shift) & 63);
+        flat[n] = (unsigned char) gibbs_threshold_sparse(&single, gibbs_weight);
+    }
+
+    //  Start the worker threads once; they are reused by every iteration.
+    unsigned char *dirty_map = (unsigned char*) alloc_buffer(width * height);
+    unsigned char *moved_map = (unsigned char*) alloc_buffer(width * height);
+    unsigned char *scratch   = (unsigned char*) alloc_buffer(width * height);
+
+    struct GibbsStage stage = { select_tile(byte_depth, &stencil), NULL, NULL, &stencil, gibbs_weight, bin_shift,
+                                (int) env_or("SEG_COARSE", COARSE), env_or("SEG_FLAT", FLAT) ? flat : NULL,
+                                fixed_weight, (int) env_or("SEG_FIXED_POINT_REPORT", FIXED_POINT_REPORT), 0,
+                                NULL, moved_map,
+                                width, height, frame->byte_width, byte_depth,
+                                frame->pixel_stride, frame->channel_stride,
+                                stencil_rows - frame->pad_rows, height - stencil_rows + frame->pad_rows,
+                                stencil_cols - frame->pad_cols, width  - stencil_cols + frame->pad_cols, 0, 0 };
+    if (image_depth < byte_depth && env_or("SEG_LANES", LANES) && gibbs_threshold_lanes != NULL &&
+        taps <= lane_taps && bin_shift == 0 && frame->channel_stride == 1)
+    {
+        sort_network(&stencil);
+        stage.tile = gibbs_tile_lanes;
+    }
+    size_tiles(&stage);
+    struct WorkerPool pool;
+    stage.img_copy = frame_copy;
+    stage.img_mask = frame_mask;
+    start_pool(&pool, &stage, threads, env_or("SEG_NUMA", NUMA) ? frame : NULL);
+
+    //  The image goes in once the workers placed their bands. Without a border policy,
+    //  the border the first iteration does not compute stays blank, as in scalar.
+    to_frame(frame_mask, frame, img, byte_width, width, height, byte_depth);
+    if (BORDER != BORDER_NONE)
+        fill_border(frame_mask, frame, width, height, byte_depth, BORDER);
+
+    //  Iterate until a pass changes less than the convergence fraction, or up to the cap.
+    double    convergence = env_or("SEG_CONVERGENCE", CONVERGENCE);
+    long long computed    = (long long) (stage.last_row - stage.first_row) *
+                                        (stage.last_col - stage.first_col) * byte_depth;
+    int       settled[MAX_CHANNELS] = { 0 };
+
+    //  Or run them all at once as a wavefront.
+    h = 0;
+    if (env_or("SEG_WAVEFRONT", WAVEFRONT) && iterations > 1)
+    {
+        unsigned char *result = run_wavefront(&pool, frame, frame_mask, frame_copy, iterations);
+        frame_copy = (result == frame_mask) ? frame_copy : frame_mask;
+        frame_mask = result;
+        h = iterations;
+    }
+    for (; h < iterations; h++)
+    {
+        //  In the beginning of every iteration:
+        //      img_copy is the one that was iterated,
+        //      img_mask is the result of iteration.
+        //  Data always flows from img_copy -> img_mask.
+        //  Switch these two to modify the content of img_mask again.
+        unsigned char *img_to_modify = frame_mask;
+        frame_mask = frame_copy;
+        frame_copy = img_to_modify;
+
+        //  The swap is the only point the workers synchronize on.
+        stage.img_copy = frame_copy;
+        stage.img_mask = frame_mask;
+        long long changed = run_pool(&pool);
+        int converged = (image_depth < byte_depth) ?
+                        settle_images(&stage, image_depth, convergence, settled) == 0 :
+                        changed < convergence * computed;
+        if (BORDER != BORDER_NONE)
+            fill_border(frame_mask, frame, width, height, byte_depth, BORDER);
+        printf("Iteration %d done. %lld pixel channels changed.\n", h+1, changed);
+        if (fixed_weight != NULL && stage.fixed_report)
+            printf("Fixed point and double disagreed on %lld pixel channels.\n", stage.fixed_differ);
+        stage.fixed_differ = 0;
+        if (converged)
+        {
+            h++;
+            break;
+        }
+
+        //  The next iteration only recomputes around what this one changed, unless that
+        //  is nearly everything and checking every pixel would only cost time.
+        if (INCREMENTAL && h+1 < iterations)
+        {
+            stage.dirty = dirty_map;
+            long long dirty = dilate_changes(&stage, scratch);
+            if (4*dirty > 3LL * width * height)
+                stage.dirty = NULL;
+            printf("%lld pixels to recompute.\n", dirty);
+        }
+    }
+    stop_pool(&pool);
+    free_buffer(dirty_map);
+    free_buffer(moved_map);
+    free_buffer(scratch);
+    printf("Used %d of at most %d iterations.\n", h, iterations);
+
+    //  Back to the bitmap layout. The caller may keep reading the frame.
+    from_frame(img, byte_width, frame_mask, frame, width, height, byte_depth);
+
+    free_buffer(frame_copy - frame->lead);
+    free_stencil(&stencil);
+    free(gibbs_weight);
+    free(fixed_weight);
+    return frame_mask;
+}
+
+void gibbs_pyramid(unsigned char *img, int byte_width, int width, int height, int byte_depth,
+                   int partition, int levels, int iterations, int threads)
+{
+    //  Replaces img by the upsampled result of segmenting it at half its size, which
+    //  itself starts from the result at a quarter of its size, and so on for levels
+    //  levels. A level whose neighborhood would shrink below one pixel ends the chain.
+    int half_width = width/2, half_height = height/2;
+    int half_byte_width = half_width * byte_depth;
+    int i, j, k;
+    if (levels <= 0 || half_width < partition || half_height < partition)
+        return;
+
+    //  2x2 box average, as every output pixel of the MRF stands for its neighborhood.
+    unsigned char *half = (unsigned char*) alloc_buffer((size_t) half_byte_width * half_height);
+    for (i = 0; i < half_height; i++)
+        for (j = 0; j < half_width; j++)
+            for (k = 0; k < byte_depth; k++)
+            {
+                unsigned char *quad = &img[2*i*byte_width + 2*j*byte_depth + k];
+                half[i*half_byte_width + j*byte_depth + k] = (unsigned char)
+                    ((quad[0] + quad[byte_depth] + quad[byte_width] + quad[byte_width+byte_depth] + 2) >> 2);
+            }
+
+    gibbs_pyramid(half, half_byte_width, half_width, half_height, byte_depth, partition, levels-1, iterations, threads);
+    printf("Pyramid level %dx%d:\n", half_width, half_height);
+    struct Frame frame;
+    free_buffer(gibbs_mrf(half, half_byte_width, half_width, half_height, byte_depth, byte_depth,
+                          partition, iterations, threads, &frame) - frame.lead);
+
+    //  Nearest neighbor upsampling, so the thresholded luminances stay the ones the MRF
+    //  chose instead of blending into new ones along the boundaries.
+    for (i = 0; i < height; i++)
+        for (j = 0; j < width; j++)
+        {
+            int y = (i/2 < half_height) ? i/2 : half_height-1;
+            int x = (j/2 < half_width)  ? j/2 : half_width-1;
+            for (k = 0; k < byte_depth; k++)
+                img[i*byte_width + j*byte_depth + k] = half[y*half_byte_width + x*byte_depth + k];
+        }
+    free_buffer(half);
+}
+
+double fit_deadline(double deadline, int width, int height, int byte_depth, int threads,
+                    int *partition, int *iterations)
+{
+    //  Lowers *partition's radius and *iterations until the estimated Gibbs stage fits in
+    //  deadline milliseconds, down to radius 1 and a single iteration.
+    //  Returns the estimate in milliseconds.
+    double pixel_ns = env_or("SEG_DEADLINE_PIXEL_NS", DEADLINE_PIXEL_NS);
+    double tap_ns   = env_or("SEG_DEADLINE_TAP_NS", DEADLINE_TAP_NS);
+    double channels = (double) width * height * byte_depth / threads;
+    int size = (width < height) ? width : height;
+    int most = size / *partition, h, p;
+    for (h = *iterations; h >= 1; h--)
+        for (p = *partition; p <= size; p++)
+        {
+            int radius = size / p;
+            double estimate = h * channels * (pixel_ns + tap_ns * (2*radius+1)) * 1e-6;
+            if (radius < ((h > 1) ? (most+1)/2 : 1))
+                break;
+            if (estimate <= deadline || (h == 1 && radius == 1))
+            {
+                *partition  = p;
+                *iterations = h;
+                return estimate;
+            }
+            while (p < size && size/(p+1) == radius)
+                p++;
+        }
+    return 0;
+}
+
+unsigned char *region_mask(unsigned char *frame_mask, struct Frame *frame, int width, int height,
+                           int byte_depth, int byte_width, int image_size)
+{
+    //  Mask of the region around the center, laid out as the bitmap: 1 on every channel
+    //  of a pixel that shares a thresholded luminance with the center pixel and is
+    //  connected to it through such pixels. The thresholded MRF is read from the Gibbs
+    //  frame, byte_depth channels from frame_mask on.
+    int i, j;
+    int fw = frame->byte_width, ps = frame->pixel_stride, cs = frame->channel_stride;
+    int midX = height / 2;
+    int midY = width  / 2;
+    unsigned char *center   = &frame_mask[midX * fw + midY * ps];
+    unsigned char *BFSArray = (unsigned char*) alloc_buffer(image_size);
+    struct Node   *visiting = (struct Node*) malloc(sizeof(struct Node));
+          visiting->row     = midX;
+          visiting->column  = midY;
+          visiting->next    = NULL;
+    struct Node *last_in_queue  = visiting;
+    while (visiting != NULL) 
+    {
+        //  Check all 4 vertical and horizontal neighbors.
+        int past_col=-1, col=-1, row=0;
+        for (i=0; i<4; i++, past_col=col, col=row*-1, row=past_col)
+        {
+            //  Index of the neighbor
+            int x = visiting->row+row;
+            int y = visiting->column+col;
+
+            //  Tests
+            // 1. The visiting struct Node is always "valid (has 1 same RGB as center)"
+            // 2. If neighbor is not valid, move on. If "valid" and unvisited, mark valid and add to queue
+            // 3. On mask, 0 is unvisited, 1 is valid
+            if ((x|y) < 0 || x >= height || y >= width) //  Boundary check
+                continue;
+            if (BFSArray[x*byte_width + y*byte_depth]) //  If already marked valid, don't check again
+                continue;
+            for (j = 0; j < byte_depth; j++)
+                j = (frame_mask[x*fw + y*ps + j*cs] == center[j*cs]) ? byte_depth+1 : j;
+            if (j < byte_depth+1)
+                continue;
+
+            //  The pixel is valid. Mark as valid and add to queue.
+            for (j = 0; j < byte_depth; j++)
+                BFSArray[x*byte_width + y*byte_depth + j] = 1;
+
+            last_in_queue->next = (struct Node*) malloc(sizeof(struct Node));
+            last_in_queue       = last_in_queue->next;
+
+            last_in_queue->row    = x;
+            last_in_queue->column = y;
+            last_in_queue->next   = NULL;
+        }
+       
+        struct Node *to_visit = visiting->next;
+        free(visiting);
+        visiting = to_visit; //free struct Node and move on to the next on the list
+    }
+    return BFSArray;
+}
+
+int run_batch(int count)
+{
+    //  Segments image0.bmp .. image<count-1>.bmp, all of one size and depth, stacked
+    //  MAX_CHANNELS channels at a time: channel n*byte_depth+k of a stacked pixel is
+    //  channel k of image n. Each image is then masked and saved as main does.
+    struct timespec time1, time2, result;
+    clock_gettime(CLOCK_MONOTONIC, &time1);
+    BMPINFOHEADER  *info = (BMPINFOHEADER*) malloc(count * sizeof(BMPINFOHEADER));
+    unsigned char **img  = (unsigned char**) calloc(count, sizeof(unsigned char*));
+    char name[64];
+    int n, i, j, k, first, status;
+    for (n = 0; n < count; n++)
+    {
+        snprintf(name, sizeof(name), "image%d.bmp", n);
+        if (load_bitmap(name, &info[n], &img[n]) != 0)
+        {
+            printf("ERROR: 1. Could not read %s\n", name);
+            return 0;
+        }
+        if (info[n].Width != info[0].Width || info[n].Height != info[0].Height ||
+            info[n].bitPerPix != info[0].bitPerPix)
+        {
+            printf("ERROR: 8. %s is not as large or as deep as image0.bmp\n", name);
+            return 0;
+        }
+    }
+
+    int width       = info[0].Width, height = info[0].Height, size = info[0].ImageSize;
+    int byte_depth  = info[0].bitPerPix / 8;
+    int byte_padd   = (4 - (width * byte_depth & 0x3)) & 0x3;
+    int byte_width  = width * byte_depth + byte_padd;
+    int threads     = (int) env_or("SEG_THREADS", THREADS);
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    int iterations  = (int) env_or("SEG_ITERATIONS", ITERATIONS);
+    int partition   = (int) env_or("SEG_PARTITION", PARTITION);
+    int group       = (MAX_CHANNELS / byte_depth > 0) ? MAX_CHANNELS / byte_depth : 1;
+
+    for (first = 0; first < count; first += group)
+    {
+        int images   = (count - first < group) ? count - first : group;
+        int channels = images * byte_depth;
+        unsigned char *stack = (unsigned char*) alloc_buffer((size_t) width * height * channels);
+        for (n = 0; n < images; n++)
+            for (i = 0; i < height; i++)
+                for (j = 0; j < width; j++)
+                    for (k = 0; k < byte_depth; k++)
+                        stack[((size_t) i*width + j)*channels + n*byte_depth + k] =
+                            img[first+n][i*byte_width + j*byte_depth + k];
+
+        printf("Images %d to %d:\n", first, first+images-1);
+        struct Frame frame;
+        unsigned char *frame_mask = gibbs_mrf(stack, width*channels, width, height, channels, byte_depth,
+                                              partition, iterations, threads, &frame);
+
+        for (n = 0; n < images; n++)
+        {
+            //  Thresholded image, then the mask of its own channels of the frame.
+            unsigned char *img_mask = (unsigned char*) alloc_buffer(size);
+            memcpy(img_mask, img[first+n], size);
+            for (i = 0; i < height; i++)
+                for (j = 0; j < width; j++)
+                    for (k = 0; k < byte_depth; k++)
+                        img_mask[i*byte_width + j*byte_depth + k] =
+                            stack[((size_t) i*width + j)*channels + n*byte_depth + k];
+            snprintf(name, sizeof(name), "image%d_mask.bmp", first+n);
+            if ((status = overwrite_bitmap(name, &img_mask)) != 0)
+                printf("ERROR: 6. Could not write %s (%d)\n", name, status);
+            free_buffer(img_mask);
+
+            unsigned char *BFSArray = region_mask(frame_mask + n*byte_depth*frame.channel_stride, &frame,
+                                                  width, height, byte_depth, byte_width, size);
+            apply_mask(img[first+n], BFSArray, size);
+            free_buffer(BFSArray);
+        }
+        free_buffer(frame_mask - frame.lead);
+        free_buffer(stack);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &time2);
+    result = diff(time1, time2);
+    long int code_duration = 1000000000 * result.tv_sec + result.tv_nsec;
+    printf("\n::: Duration: %ldns for %d images\n\n", code_duration, count);
+
+    for (n = 0; n < count; n++)
+    {
+        snprintf(name, sizeof(name), "image%d.bmp", n);
+        if ((status = overwrite_bitmap(name, &img[n])) != 0)
+            printf("ERROR: 4. Could not write %s (%d)\n", name, status);
+        free_buffer(img[n]);
+    }
+    free(img);
+    free(info);
+    return 0;
+}
+
+int main(){
+
+    //  0. Initialize timestamp calculator (wall clock, as the Gibbs stage is multithreaded)
+    struct timespec time1, time2, result;
+    clock_gettime(CLOCK_MONOTONIC, &time1);
+
+    //  1. Load bitmap, after picking the kernels for this CPU.
+    //     A batch of same-sized bitmaps is segmented on its own.
+    select_isa();
+    int batch = (int) env_or("SEG_BATCH", BATCH);
+    if (batch > 0)
+        return run_batch(batch);
+    char          *img_name = "image.bmp";
+    char          *img_mask_name = "image_mask.bmp";
+    BMPINFOHEADER  img_info;
+    unsigned char *img;
+    int status = load_bitmap(img_name, &img_info, &img);
+    if (status == -1) {
+        printf("ERROR: 1. File DNE\n");
+        return 0;
+    } else if (status == -2){
+        printf("ERROR: 2. Could not allocate memory\n");
+        return 0;
+    } else if (status != 0) {
+        printf("ERROR: 3. Only read %d bytes\n", status);
+        return 0;
+    }
+
+    //  2. Copy the original image in a separate buffer and leave the original untouched.
+    unsigned char *img_mask = (unsigned char*) alloc_buffer(img_info.ImageSize);
+    int g;
+    for (g = 0; g < img_info.ImageSize; g++)
+        img_mask[g] = img[g];
+
+    //  3. Relate image areas by thresholding PDF of Markovian Gibbs Probability
+    //    (Refer to: Image Prediction)
+    /*
+        These are some variable descriptions. 
+        It'll be easier to understand if you read Bitmap Wikipedia.
+
+        byte_depth  : how many bytes are per pixel.
+        byte_padd   : how many bytes used to align the xs by 4 bytes
+        byte_width  : how many bytes are per x INCLUDING the padding
+        byte_offset : the radius that bounds what pixels are considered neighbors in MRF,
+                      derived from the size of the image by gibbs_mrf
+    */
+    int byte_depth  = img_info.bitPerPix / 8;
+    int byte_padd   = (4 - img_info.Width * byte_depth & 0x3) & 0x3;
+    int byte_width  = img_info.Width * byte_depth + byte_padd;
+
+    //  Segment smaller copies of the image first, when asked to. The full resolution
+    //  image, whose neighborhood is the largest, then starts from their result and only
+    //  needs a few refining iterations.
+    int threads = (int) env_or("SEG_THREADS", THREADS);
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    int iterations = (int) env_or("SEG_ITERATIONS", ITERATIONS);
+    int partition  = (int) env_or("SEG_PARTITION", PARTITION);
+    int levels     = (int) env_or("SEG_PYRAMID", PYRAMID);
+    double deadline = env_or("SEG_DEADLINE", DEADLINE);
+    if (deadline > 0 && levels <= 0)
+    {
+        double estimate = fit_deadline(deadline, img_info.Width, img_info.Height, byte_depth, threads,
+                                       &partition, &iterations);
+        printf("Deadline of %.0f ms: PARTITION %d (radius %d) and %d iterations, estimated at %.0f ms.\n",
+               deadline, partition, ((img_info.Width < img_info.Height) ? img_info.Width : img_info.Height)/partition,
+               iterations, estimate);
+    }
+    int tlb_counter = open_tlb_counter();
+    if (levels > 0)
+    {
+        gibbs_pyramid(img_mask, byte_width, img_info.Width, img_info.Height, byte_depth,
+                      partition, levels, iterations, threads);
+        iterations = (int) env_or("SEG_PYRAMID_PASSES", PYRAMID_PASSES);
+        printf("Full resolution:\n");
+    }
+    struct Frame frame;
+    unsigned char *frame_mask = gibbs_mrf(img_mask, byte_width, img_info.Width, img_info.Height, byte_depth,
+                                          byte_depth, partition, iterations, threads, &frame);
+    long long tlb_misses;
+    if (tlb_counter >= 0 && read(tlb_counter, &tlb_misses, sizeof(tlb_misses)) == sizeof(tlb_misses))
+        printf("dTLB load misses of the Gibbs stage: %lld\n", tlb_misses);
+    else
+        printf("dTLB load misses of the Gibbs stage cannot be counted here.\n");
+    if (tlb_counter >= 0)
+        close(tlb_counter);
+
+    //  4. Save thresholded MRF image
+    status = overwrite_bitmap(img_mask_name, &img_mask);
+    if (status == -1) {
+        printf("ERROR: 6. Could not open file\n");
+        return 0;
+    } else if (status != 0) {
+        printf("ERROR: 7. Only wrote %d bytes\n", status);
+        return 0;
+    }
+    
+    //  5. Produce Mask from Thresholded MRF using BFS
+    unsigned char *BFSArray = region_mask(frame_mask, &frame, img_info.Width, img_info.Height,
+                                          byte_depth, byte_width, img_info.ImageSize);
+
+    //  6. Apply mask to image
+    apply_mask(img, BFSArray, img_info.ImageSize);
+
+    //  7. Calculate code duration
+    clock_gettime(CLOCK_MONOTONIC, &time2);
+    result = diff(time1, time2);
+    long int code_duration = 1000000000 * result.tv_sec + result.tv_nsec;
+    printf("\n::: Duration: %ldns\n\n", code_duration);
+    
+    //  8. Save segmented image
+    status = overwrite_bitmap(img_name, &img);
+    if (status == -1) {
+        printf("ERROR: 4. Could not open file\n");
+        return 0;
+    } else if (status != 0) {
+        printf("ERROR: 5. Only wrote %d bytes\n", status);
+        return 0;
+    }
+
+    free_buffer(img);
+    free_buffer(img_mask);
+    free_buffer(frame_mask - frame.lead);
+    free_buffer(BFSArray);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
@@ -21,6 +22,20 @@
 // Higher PARTITION means lower MRF ORDER. (PARTITION = SIZE/ORDER)
 #define PARTITION 60
 
+// Shape of the MRF neighborhood. A DISK holds the taps with l*l + m*m <= order,
+// a SQUARE the whole (2*order+1)^2 window, and an ELLIPSE divides each image
+// dimension by PARTITION separately, so non-square images get an anisotropic one.
+#define STENCIL_DISK    0
+#define STENCIL_SQUARE  1
+#define STENCIL_ELLIPSE 2
+#define STENCIL STENCIL_DISK
+
+// Luminances that no neighbor uses all share one baseline PDF weight, so the Gibbs CDF
+// is a ramp with bumps at the occupied luminances. Neighborhoods with at most this many
+// distinct luminances are thresholded in closed form from those bumps alone, busier
+// ones still build the full 256-entry CDF.
+#define SPARSE_BINS 160
+
 #pragma pack(push, 1)
 typedef struct
 {
@@ -49,6 +64,22 @@ struct Node //struct used for linked lists
     struct Node *next;
 };
 
+struct Histogram //luminance counts of one channel's Markovian neighbors
+{
+    int count[256];
+    int distinct;                   // how many luminances have a nonzero count
+    unsigned long long occupied[4]; // bit lum is set while count[lum] > 0
+};
+
+struct Stencil //MRF neighborhood stored as spans, computed once per image
+{
+    int rows, cols;     // half-height and half-width of the bounding box
+    int *mStart, *mEnd; // row l covers columns mStart[l]..mEnd[l], for l = -rows..rows
+    int *lStart, *lEnd; // column m covers rows lStart[m]..lEnd[m], for m = -cols..cols
+    int *offset;        // byte offset of every tap from the center pixel, row by row
+    int taps;
+};
+
 struct timespec diff(struct timespec start, struct timespec end)
 {
   struct timespec temp;
@@ -111,6 +142,141 @@ int overwrite_bitmap(char *filename, unsigned char **img)
     return 0;
 }
 
+void build_stencil(struct Stencil *stencil, int shape, int rows, int cols, int byte_width, int byte_depth)
+{
+    //  All shapes are convex, so every row and every column of taps is one span.
+    //  An ellipse with radii rows, cols holds l*l*cols*cols + m*m*rows*rows <= (rows*cols)^2.
+    long long r2 = (long long) rows*rows, c2 = (long long) cols*cols;
+    int l, m, n = 0;
+    stencil->rows   = rows;
+    stencil->cols   = cols;
+    stencil->mStart = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+    stencil->mEnd   = (int*) malloc((2*rows+1) * sizeof(int)) + rows;
+    stencil->lStart = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+    stencil->lEnd   = (int*) malloc((2*cols+1) * sizeof(int)) + cols;
+    stencil->taps   = 0;
+    for (m = -cols; m <= cols; m++)
+    {
+        stencil->lStart[m] = rows + 1;
+        stencil->lEnd[m]   = -rows - 1;
+    }
+    for (l = -rows; l <= rows; l++)
+    {
+        int span = cols;
+        if (shape != STENCIL_SQUARE)
+            for (span = 0; span < cols && l*l*c2 + (span+1)*(span+1)*r2 <= r2*c2; span++);
+        stencil->mStart[l] = -span;
+        stencil->mEnd[l]   =  span;
+        stencil->taps     += 2*span + 1;
+        for (m = -span; m <= span; m++)
+        {
+            if (stencil->lStart[m] > l) stencil->lStart[m] = l;
+            if (stencil->lEnd[m]   < l) stencil->lEnd[m]   = l;
+        }
+    }
+
+    stencil->offset = (int*) malloc(stencil->taps * sizeof(int));
+    for (l = -rows; l <= rows; l++)
+        for (m = stencil->mStart[l]; m <= stencil->mEnd[l]; m++)
+            stencil->offset[n++] = l*byte_width + m*byte_depth;
+}
+
+void free_stencil(struct Stencil *stencil)
+{
+    free(stencil->mStart - stencil->rows);
+    free(stencil->mEnd   - stencil->rows);
+    free(stencil->lStart - stencil->cols);
+    free(stencil->lEnd   - stencil->cols);
+    free(stencil->offset);
+}
+
+void add_neighbor(struct Histogram *hist, unsigned char *pixel, int byte_depth, int weight)
+{
+    //  Count (or uncount, with weight -1) every channel of one neighbor pixel.
+    //  A luminance toggles its occupied bit when its count leaves or returns to 0.
+    int k;
+    for (k = 0; k < byte_depth; k++)
+    {
+        int lum = pixel[k];
+        hist[k].count[lum] += weight;
+        if (hist[k].count[lum] == (weight > 0))
+        {
+            hist[k].occupied[lum >> 6] ^= 1ULL << (lum & 63);
+            hist[k].distinct += weight;
+        }
+    }
+}
+
+int gibbs_threshold_dense(struct Histogram *hist, double *gibbs_weight)
+{
+    // Initialize Gibbs CDF array
+    double gibbs_CDF[257];      // Gibbs PDF for this pixel (i,j)'s
+                                // luminance to be 0,1...255 or lower 
+                                // based on Markovian neighbor values.
+           gibbs_CDF[0] = 0;    // The first element is for making CDF 
+                                // generation easier by having an index 0
+                                // for lum -1, whose gibbs_PDF is 0.
+
+    // Generate CDF from the Gibbs weight of each luminance's shortfall from the peak count
+    int lum, peak = 0;
+    for (lum = 0; lum <= 255; lum++)
+        peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+    for (lum = 0; lum <= 255; lum++)
+        gibbs_CDF[lum+1] = gibbs_CDF[lum] + gibbs_weight[peak - hist->count[lum]];
+
+    // Threshold CDF
+    for (lum = 0; lum <= 255; lum++)
+        if (gibbs_CDF[lum+1]/gibbs_CDF[256] > THRESHOLD)
+            return lum;
+    return -1;
+}
+
+int gibbs_threshold_sparse(struct Histogram *hist, double *gibbs_weight)
+{
+    //  With the baseline weight w0 of an unused luminance, the CDF up to lum is
+    //  (lum+1)*w0 plus the excess weight of the occupied luminances <= lum.
+    //  Only the occupied luminances, taken in ascending order from the bitmap, are visited.
+    //  An unused luminance is as many counts short of the most frequent one as it has.
+    double w0, excess = 0, target;
+    int word, lum, peak = 0, next = 0;
+    unsigned long long bits;
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+        {
+            lum  = (word << 6) + __builtin_ctzll(bits);
+            peak = (hist->count[lum] > peak) ? hist->count[lum] : peak;
+        }
+    w0 = gibbs_weight[peak];
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+            excess += gibbs_weight[peak - hist->count[(word << 6) + __builtin_ctzll(bits)]] - w0;
+    target = THRESHOLD * (256*w0 + excess);
+
+    excess = 0;
+    for (word = 0; word < 4; word++)
+        for (bits = hist->occupied[word]; bits; bits &= bits - 1)
+        {
+            lum = (word << 6) + __builtin_ctzll(bits);
+
+            //  First crossing on the ramp of unused luminances next..lum-1
+            double ramp = (target - excess) / w0;
+            if (ramp < lum)
+                return (ramp < next) ? next : (int) ramp;
+
+            //  Crossing at the occupied luminance itself
+            excess += gibbs_weight[peak - hist->count[lum]] - w0;
+            if ((lum+1)*w0 + excess > target)
+                return lum;
+            next = lum + 1;
+        }
+
+    //  Crossing on the ramp after the last occupied luminance
+    double ramp = (target - excess) / w0;
+    if (ramp < 256)
+        return (ramp < next) ? next : (int) ramp;
+    return 255;
+}
+
 int main(){
 
     //  0. Initialize timestamp calculator
@@ -157,7 +323,28 @@ int main(){
     int byte_width  = img_info.Width * byte_depth + byte_padd;
     int byte_offset = (img_info.Width < img_info.Height) ? 
                         img_info.Width/PARTITION : img_info.Height/PARTITION;
-    int h, i, j, k;
+    int h, i, j, k, l, m, n;
+
+    //  Neighborhood taps of every pixel, as spans and as byte offsets from the pixel.
+    //  The Gibbs stage covers the pixels whose whole neighborhood lies inside the image.
+    struct Stencil stencil;
+    if (STENCIL == STENCIL_ELLIPSE)
+        build_stencil(&stencil, STENCIL, img_info.Height/PARTITION, img_info.Width/PARTITION, byte_width, byte_depth);
+    else
+        build_stencil(&stencil, STENCIL, byte_offset, byte_offset, byte_width, byte_depth);
+    int taps  = stencil.taps;
+    int *mStart = stencil.mStart, *mEnd = stencil.mEnd;
+    int *lStart = stencil.lStart, *lEnd = stencil.lEnd;
+
+    //  The Gibbs energy of a luminance only depends on how many neighbors share it:
+    //  E = (order << 2) - 5*count. Only PDF weights exp(-E/TEMPERATURE) relative to each
+    //  other matter to the threshold, so they are taken relative to the neighborhood's most
+    //  frequent luminance, exp(-5*(peak - count)/TEMPERATURE), which never overflows at any
+    //  radius. They are tabulated once per image for every shortfall 0..taps.
+    double *gibbs_weight = (double*) malloc((taps+1) * sizeof(double));
+    for (n = 0; n <= taps; n++)
+        gibbs_weight[n] = exp(-5.0*n/TEMPERATURE);
+
     for (h = 0; h < ITERATIONS; h++)
     {
         //  In the beginning of every iteration:
@@ -169,42 +356,53 @@ int main(){
         img_mask = img_copy;
         img_copy = img_to_modify;
 
-        for (i = byte_offset; i < img_info.Height-byte_offset; i++)
-            for (j = byte_offset; j < img_info.Width-byte_offset; j++)
+        //  Neighbor luminance counts of every channel for the current pixel (i,j).
+        //  Rows are walked in serpentine order, so moving to the next pixel is always a
+        //  one-step slide of the stencil: only its leaving edge is removed and its entering
+        //  edge added, instead of recounting every tap.
+        struct Histogram hist[4];
+        int row_length = img_info.Width - 2*stencil.cols;
+        memset(hist, 0, sizeof(hist));
+        if (row_length > 0 && img_info.Height > 2*stencil.rows)
+            for (n = 0; n < taps; n++)
+                add_neighbor(hist, &img_copy[stencil.rows*byte_width + stencil.cols*byte_depth + stencil.offset[n]], byte_depth, 1);
+
+        for (i = stencil.rows; i < img_info.Height-stencil.rows; i++)
+        {
+            int dir = ((i-stencil.rows) & 1) ? -1 : 1;
+            int *leaving  = (dir > 0) ? mStart : mEnd;
+            int *entering = (dir > 0) ? mEnd : mStart;
+            j = (dir > 0) ? stencil.cols : img_info.Width-stencil.cols-1;
+            for (n = 0; n < row_length; n++, j += dir)
+            {
+                //  Slide the stencil horizontally from the previous pixel (i,j-dir).
+                if (n > 0)
+                    for (l = -stencil.rows; l <= stencil.rows; l++)
+                    {
+                        unsigned char *row = &img_copy[(i+l)*byte_width];
+                        add_neighbor(hist, &row[(j-dir+leaving[l])*byte_depth], byte_depth, -1);
+                        add_neighbor(hist, &row[(j   +entering[l])*byte_depth], byte_depth,  1);
+                    }
+
                 for (k = 0; k < byte_depth; k++)
                 {
-                    // Initialize Gibbs CDF array
-                    double gibbs_CDF[257];      // Gibbs PDF for this pixel (i,j)'s
-                                                // luminance to be 0,1...255 or lower 
-                                                // based on Markovian neighbor values.
-                           gibbs_CDF[0] = 0;    // The first element is for making CDF 
-                                                // generation easier by having an index 0
-                                                // for lum -1, whose gibbs_PDF is 0.
-                    int lum, order = byte_offset*byte_offset;
-                    for (lum = 0; lum <= 255; lum++) ///////////////// Optimizable
-                        gibbs_CDF[lum+1] = order << 2;
-
-                    // Calculate Equipotential of each luminance using Markovian Neighbors
-                    int l, m;
-                    for (l = -byte_offset; l <= byte_offset; l++)
-                        for (m = -byte_offset; m <= byte_offset; m++)
-                        {
-                            int lum = img_copy[(i+l)*byte_width + (j+m)*byte_depth + k] + 1;
-                            gibbs_CDF[lum] -= (l*l + m*m <= order) ? 5 : 0;
-                        }
-
-                    // Generate CDF
-                    for (lum = 0; lum <= 255; lum++)
-                        gibbs_CDF[lum+1] = gibbs_CDF[lum] + exp(-gibbs_CDF[lum+1]/TEMPERATURE);
-
-                    // Threshold CDF
-                    for (lum = 0; lum <= 255; lum++)
-                        if (gibbs_CDF[lum+1]/gibbs_CDF[256] > THRESHOLD)
-                        {
-                            img_mask[i*byte_width+j*byte_depth+k] = (unsigned char) lum;
-                            lum = 256;
-                        }
+                    int lum = (hist[k].distinct <= SPARSE_BINS) ?
+                                gibbs_threshold_sparse(&hist[k], gibbs_weight) :
+                                gibbs_threshold_dense (&hist[k], gibbs_weight);
+                    if (lum >= 0)
+                        img_mask[i*byte_width+j*byte_depth+k] = (unsigned char) lum;
                 }
+            }
+
+            //  Slide the stencil one row down, staying on the column the row ended at.
+            j -= dir;
+            if (i+1 < img_info.Height-stencil.rows)
+                for (m = -stencil.cols; m <= stencil.cols; m++)
+                {
+                    add_neighbor(hist, &img_copy[(i  +lStart[m])*byte_width + (j+m)*byte_depth], byte_depth, -1);
+                    add_neighbor(hist, &img_copy[(i+1+lEnd[m]  )*byte_width + (j+m)*byte_depth], byte_depth,  1);
+                }
+        }
         printf("Iteration %d done.\n", h+1);
     }
 
@@ -292,5 +490,7 @@ int main(){
     free(img_mask);
     free(img_copy);
     free(BFSArray);
+    free_stencil(&stencil);
+    free(gibbs_weight);
     return 0;
 }